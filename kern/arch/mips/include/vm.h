@@ -128,12 +128,13 @@ paddr_t ram_getfirstfree(void);
  */
 
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	uint32_t ts_asid;		/* ASID, with its generation */
+	vaddr_t ts_vaddr;		/* page to drop, or TS_ALL */
+	volatile bool *ts_done;		/* if set, flag to raise, by cpu */
 };
 
+#define TS_ALL 1			/* drop every entry with the ASID */
+
 #define TLBSHOOTDOWN_MAX 16
 
 
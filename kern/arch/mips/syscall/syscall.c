@@ -142,6 +142,18 @@ syscall(struct trapframe *tf)
 		err = sys_getpid(&retval);
 		break;
 
+	    case SYS_getrusage:
+		err = sys_getrusage(tf->tf_a0, (userptr_t)tf->tf_a1);
+		break;
+
+	    case SYS_getrlimit:
+		err = sys_getrlimit(tf->tf_a0, (userptr_t)tf->tf_a1);
+		break;
+
+	    case SYS_setrlimit:
+		err = sys_setrlimit(tf->tf_a0, (const_userptr_t)tf->tf_a1);
+		break;
+
 
 	    /* file calls */
 
@@ -262,6 +274,37 @@ syscall(struct trapframe *tf)
 		break;
 
 
+	    /* memory calls */
+
+	    case SYS_sbrk:
+		err = sys_sbrk((intptr_t)tf->tf_a0, &retval);
+		break;
+
+	    case SYS_mmap:
+		{
+			/*
+			 * The offset is 64 bits wide and would need an
+			 * aligned register pair, so like lseek's whence it
+			 * is on the stack.
+			 */
+			off_t offset;
+
+			err = copyin((userptr_t)tf->tf_sp + 16,
+				     &offset, sizeof(off_t));
+			if (err) {
+				break;
+			}
+
+			err = sys_mmap(tf->tf_a0, tf->tf_a1, tf->tf_a2,
+				       offset, &retval);
+		}
+		break;
+
+	    case SYS_munmap:
+		err = sys_munmap((userptr_t)tf->tf_a0);
+		break;
+
+
 
 	    default:
 		kprintf("Unknown syscall %d\n", callno);
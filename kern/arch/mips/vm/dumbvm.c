@@ -35,6 +35,8 @@
 #include <spinlock.h>
 #include <proc.h>
 #include <current.h>
+#include <uio.h>
+#include <vnode.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
@@ -311,6 +313,40 @@ as_zero_region(paddr_t paddr, unsigned npages)
 	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
 }
 
+/*
+ * dumbvm has no demand paging, so the file data is read in right away.
+ * Must be called between as_prepare_load and as_complete_load.
+ */
+int
+as_define_file(struct addrspace *as, vaddr_t vaddr, struct vnode *v,
+	       off_t offset, size_t filesize)
+{
+	struct iovec iov;
+	struct uio u;
+	int result;
+
+	iov.iov_ubase = (userptr_t)vaddr;
+	iov.iov_len = filesize;
+	u.uio_iov = &iov;
+	u.uio_iovcnt = 1;
+	u.uio_resid = filesize;
+	u.uio_offset = offset;
+	u.uio_segflg = UIO_USERSPACE;
+	u.uio_rw = UIO_READ;
+	u.uio_space = as;
+
+	result = VOP_READ(v, &u);
+	if (result) {
+		return result;
+	}
+
+	if (u.uio_resid != 0) {
+		return ENOEXEC;
+	}
+
+	return 0;
+}
+
 int
 as_prepare_load(struct addrspace *as)
 {
@@ -356,6 +392,96 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	/* dumbvm has no heap */
+	(void)as;
+	(void)amount;
+	(void)oldbreak;
+	return ENOSYS;
+}
+
+int
+as_mmap(struct addrspace *as, size_t length, int prot, struct vnode *v,
+	off_t offset, vaddr_t *addr)
+{
+	/* nor file mappings */
+	(void)as;
+	(void)length;
+	(void)prot;
+	(void)v;
+	(void)offset;
+	(void)addr;
+	return ENOSYS;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t addr)
+{
+	(void)as;
+	(void)addr;
+	return EINVAL;
+}
+
+int
+as_sync_file(struct addrspace *as, struct vnode *v)
+{
+	(void)as;
+	(void)v;
+	return 0;
+}
+
+void
+as_getusage(struct addrspace *as, struct as_usage *usage)
+{
+	/* everything is resident from the start, and nothing faults */
+	bzero(usage, sizeof(*usage));
+	usage->rss = as->as_npages1 + as->as_npages2 + DUMBVM_STACKPAGES;
+	usage->maxrss = usage->rss;
+}
+
+void
+page_cache_update(struct vnode *v, off_t start, off_t end)
+{
+	/* dumbvm caches no file pages */
+	(void)v;
+	(void)start;
+	(void)end;
+}
+
+void
+page_cache_forget(struct vnode *v)
+{
+	(void)v;
+}
+
+bool
+page_cache_shrink(bool all)
+{
+	(void)all;
+	return false;
+}
+
+void
+vm_set_faultaround(unsigned npages)
+{
+	/* dumbvm has no page table to preload from */
+	(void)npages;
+}
+
+void
+vm_print_faultaround(void)
+{
+	kprintf("dumbvm: no fault-around\n");
+}
+
+void
+vmstat_print(void)
+{
+	kprintf("dumbvm: no vm statistics\n");
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
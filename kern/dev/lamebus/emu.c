@@ -851,13 +851,16 @@ emufs_namefile(struct vnode *v, struct uio *uio)
 
 /*
  * VOP_MMAP
+ *
+ * The VM system pages mappings in and out through VOP_READ and
+ * VOP_WRITE, so files can be mapped with nothing to set up.
  */
 static
 int
 emufs_mmap(struct vnode *v)
 {
 	(void)v;
-	return ENOSYS;
+	return 0;
 }
 
 //////////////////////////////
@@ -35,6 +35,8 @@
  */
 
 
+#include <array.h>
+#include <spinlock.h>
 #include <vm.h>
 #include "opt-dumbvm.h"
 
@@ -42,9 +44,35 @@
 #define RGN_R 0x4
 #define RGN_W 0x2
 #define RGN_X 0x1
+#define RGN_MMAP   0x8          /* made by mmap, can be unmapped */
+#define RGN_SHARED 0x10         /* writes go back to the file */
 
 struct vnode;
 
+/*
+ * The stack starts out one page long and grows down on faults below it,
+ * up to the process's RLIMIT_STACK (STACK_LIMIT unless changed) and never
+ * past STACK_MAX. It is not allowed within STACK_GUARD of the region
+ * under it, so running off the end of it faults instead of scribbling
+ * on the heap. mmap places mappings top down from MMAP_TOP, clear of
+ * the largest stack.
+ */
+#define STACK_INIT_PAGES 1
+#define STACK_GUARD      (16 * PAGE_SIZE)
+#define STACK_LIMIT      (8 * 1024 * 1024)
+#define STACK_MAX        (USERSTACK - MMAP_TOP - STACK_GUARD)
+#define MMAP_TOP         (USERSTACK - 0x01000000)
+
+/* most regions that as_page_regions hands back for one page */
+#define AS_PAGE_REGIONS  3
+
+/* 
+ * The low bits of as->asid are the ASID in the tlb, the rest count 
+ * generations of ASIDs (see as_activate). AS_ENTRYHI gives the bits
+ * to put in the entryhi of the address space's tlb entries.
+ */
+#define AS_ENTRYHI(as) (((as)->asid & (NUM_ASID - 1)) << TLBHI_PIDSHIFT)
+
 /*
  * Address space - data structure associated with the virtual memory
  * space of a process.
@@ -56,7 +84,34 @@ struct region {
         vaddr_t vbase;
         size_t size;
         int accmode;
-        struct region *next;
+        struct vnode *vnode;    /* file pages are read from, or NULL */
+        vaddr_t filebase;       /* address the file data starts at */
+        off_t offset;           /* file offset of the data */
+        size_t filesize;        /* bytes of file data, the rest is zero */
+        vaddr_t ra_next;        /* next fault if access is sequential */
+        unsigned int ra_run;    /* sequential faults so far */
+        vaddr_t ra_end;         /* end of the pages read ahead */
+};
+
+#ifndef ASINLINE
+#define ASINLINE INLINE
+#endif
+
+DECLARRAY(region, ASINLINE);
+DEFARRAY(region, ASINLINE);
+
+/* 
+ * Memory accounting of an address space. The fault counts only change
+ * in the thread running in it; rss and nswap also change when another
+ * thread pages something out, so they are kept under usage_lock.
+ */
+struct as_usage {
+        unsigned int rss;       /* pages resident now */
+        unsigned int maxrss;    /* most pages resident at once */
+        unsigned int minflt;    /* faults served from memory */
+        unsigned int majflt;    /* faults that read a file or swap */
+        unsigned int cowflt;    /* copy-on-write breaks (minor faults too) */
+        unsigned int nswap;     /* pages paged out */
 };
 
 struct addrspace {
@@ -70,7 +125,16 @@ struct addrspace {
         paddr_t as_stackpbase;
 #else
         /* Put stuff here for your VM system */
-        struct region *regions;
+        struct regionarray regions;     /* sorted by vbase */
+        struct region *last_region;     /* last found by as_find_region */
+        struct region *heap;            /* grows with the break */
+        struct region *stack;           /* grows down on faults */
+        vaddr_t heap_end;               /* the break */
+        struct page_table_entry *pages; /* resident pages of this as */
+        uint32_t asid;                  /* ASID generation and number */
+        uint32_t tlb_cpus;              /* cpus that may cache its entries */
+        struct spinlock usage_lock;     /* for usage.rss and usage.nswap */
+        struct as_usage usage;
         bool load;
 #endif
 };
@@ -96,12 +160,23 @@ struct addrspace {
  *                avoid potentially "seeing" it while it's being
  *                destroyed.
  *
+ *    as_tlb_cpus - hand back the mask of cpus whose tlbs may hold entries
+ *                of the address space, and the ASID those are under.
+ *
  *    as_destroy - dispose of an address space. You may need to change
  *                the way this works if implementing user-level threads.
  *
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
+ *    as_find_region - find the region holding VADDR, or NULL.
+ *
+ *    as_page_regions - collect the regions holding any of the page at
+ *                VADDR (segments can share a page) and return how many.
+ *
+ *    as_define_file - back the region holding VADDR with a file, so its
+ *                pages are read in from the file when first touched.
+ *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
@@ -112,6 +187,24 @@ struct addrspace {
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_grow_stack - extend the stack down to cover VADDR, if the stack
+ *                limit and the regions below it allow.
+ *
+ *    as_sbrk   - move the break (the end of the heap region) by AMOUNT
+ *                bytes, handing back the old break.
+ *
+ *    as_mmap   - map LENGTH bytes of a file from OFFSET at an address of
+ *                the address space's choosing.
+ *
+ *    as_munmap - remove a mapping made by as_mmap, writing its changes
+ *                back to the file if it is shared.
+ *
+ *    as_sync_file - write back changes made through every shared mapping
+ *                of a file.
+ *
+ *    as_getusage - take a snapshot of the address space's memory
+ *                accounting.
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -120,6 +213,7 @@ struct addrspace *as_create(void);
 int               as_copy(struct addrspace *src, struct addrspace **ret);
 void              as_activate(void);
 void              as_deactivate(void);
+uint32_t          as_tlb_cpus(struct addrspace *as, uint32_t *asid);
 void              as_destroy(struct addrspace *);
 
 int               as_define_region(struct addrspace *as,
@@ -127,9 +221,23 @@ int               as_define_region(struct addrspace *as,
                                    int readable,
                                    int writeable,
                                    int executable);
+struct region    *as_find_region(struct addrspace *as, vaddr_t vaddr);
+unsigned          as_page_regions(struct addrspace *as, vaddr_t vaddr,
+                                  struct region **regions);
+int               as_define_file(struct addrspace *as, vaddr_t vaddr,
+                                 struct vnode *v, off_t offset,
+                                 size_t filesize);
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_grow_stack(struct addrspace *as, vaddr_t vaddr);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbreak);
+int               as_mmap(struct addrspace *as, size_t length, int prot,
+                          struct vnode *v, off_t offset, vaddr_t *addr);
+int               as_munmap(struct addrspace *as, vaddr_t addr);
+int               as_sync_file(struct addrspace *as, struct vnode *v);
+void              as_getusage(struct addrspace *as, struct as_usage *usage);
 
 
 /*
@@ -35,6 +35,7 @@
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
+struct frame_table_entry;	/* from <vm.h> */
 
 /*
  * Per-cpu structure
@@ -61,6 +62,16 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	uint32_t c_asid_generation;	/* ASID generation our TLB holds */
+
+	/*
+	 * Cache of free frames in front of the frame allocator.
+	 * Used by this cpu, and emptied by others when memory runs out.
+	 * Protected by the frame cache lock.
+	 */
+	struct frame_table_entry *c_free_frames;
+	unsigned c_nfree_frames;
+	struct spinlock c_frame_lock;
 
 	/*
 	 * Accessed by other cpus.
@@ -109,6 +120,14 @@ struct cpu {
  */
 struct cpu *cpu_create(unsigned hardware_number);
 void cpu_machdep_init(struct cpu *);
+
+/*
+ * cpu_count returns how many cpus there are; cpu_get returns the one
+ * with cpu number NUM.
+ */
+unsigned cpu_count(void);
+struct cpu *cpu_get(unsigned num);
+
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
@@ -155,6 +174,8 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_cpus sends the same shootdown to each CPU in a mask
+ * of CPU numbers.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -169,6 +190,7 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_cpus(uint32_t cpus, const struct tlbshootdown *mapping);
 
 void interprocessor_interrupt(void);
 
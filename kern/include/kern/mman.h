@@ -0,0 +1,23 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Protection bits for the (simplified, UNSW) mmap(), shared between
+ * the kernel and libc's <unistd.h>.
+ *
+ * That mmap() has no flags argument, so MAP_PRIVATE is or'ed into the
+ * protection bits instead. Without it, mappings are shared: writes go
+ * back to the file on munmap() and fsync(). With it, writes go to a
+ * private copy of each page and never reach the file.
+ *
+ * The MIPS TLB has no execute permission, so PROT_EXEC is accepted and
+ * treated like PROT_READ.
+ */
+
+#define PROT_READ     1      /* Pages may be read */
+#define PROT_WRITE    2      /* Pages may be written */
+#define MAP_PRIVATE   4      /* Writes are private to the process */
+#define PROT_EXEC     8      /* Pages may be executed (same as PROT_READ) */
+
+
+#endif /* _KERN_MMAN_H_ */
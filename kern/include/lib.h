@@ -123,10 +123,14 @@ uint32_t random(void);
  * Kernel heap memory allocation. Like malloc/free.
  * If out of memory, kmalloc returns NULL.
  *
+ * kmalloc_size gives the memory a kmalloc of the given size really
+ * uses, once it is rounded up to the allocator's block size.
+ *
  * kheap_nextgeneration, dump, and dumpall do nothing unless heap
  * labeling (for leak detection) in kmalloc.c (q.v.) is enabled.
  */
 void *kmalloc(size_t size);
+size_t kmalloc_size(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
 void kheap_nextgeneration(void);
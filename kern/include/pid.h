@@ -34,6 +34,8 @@
 #ifndef _PID_H_
 #define _PID_H_
 
+struct proc;
+struct rusage;
 
 #define INVALID_PID	0	/* nothing has this pid */
 #define KERNEL_PID	1	/* kernel proc has this pid */
@@ -44,9 +46,9 @@
 void pid_bootstrap(void);
 
 /*
- * Get a pid for a new thread.
+ * Get a pid for a new process.
  */
-int pid_alloc(pid_t *retval);
+int pid_alloc(struct proc *proc, pid_t *retval);
 
 /*
  * Undo pid_alloc (may blow up if the target has ever run)
@@ -59,10 +61,11 @@ void pid_unalloc(pid_t targetpid);
 void pid_disown(pid_t targetpid);
 
 /*
- * Set the exit status of the current thread to status.  Wakes up any threads
+ * Set the exit status of the current thread to status, and its resource
+ * usage (its own plus that of its children) to usage.  Wakes up any threads
  * waiting to read this status, and decrefs the current thread's pid.
  */
-void pid_setexitstatus(int status);
+void pid_setexitstatus(int status, const struct rusage *usage);
 
 /*
  * Causes the current thread to wait for the thread with pid PID to
@@ -70,5 +73,11 @@ void pid_setexitstatus(int status);
  */
 int pid_wait(pid_t targetpid, int *status, int flags, pid_t *retpid);
 
+/*
+ * Calls func on every process that has not exited yet. None of them
+ * can finish exiting until it returns.
+ */
+void pid_foreach(void (*func)(struct proc *proc, void *data), void *data);
+
 
 #endif /* _PID_H_ */
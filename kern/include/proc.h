@@ -37,7 +37,10 @@
  */
 
 #include <spinlock.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <thread.h> /* required for struct threadarray */
+#include <addrspace.h> /* required for struct as_usage */
 
 struct addrspace;
 struct vnode;
@@ -60,6 +63,9 @@ struct proc {
 
 	/* VM */
 	struct addrspace *p_addrspace;	/* virtual address space */
+	struct rlimit p_stacklimit;	/* RLIMIT_STACK */
+	struct as_usage p_execusage;	/* usage of images execv replaced */
+	struct rusage p_childusage;	/* usage of children waited for */
 
 	/* VFS */
 	struct vnode *p_cwd;		/* current working directory */
@@ -107,5 +113,17 @@ struct addrspace *proc_getas(void);
 /* Change the address space of the current process, and return the old one. */
 struct addrspace *proc_setas(struct addrspace *);
 
+/* Keep the usage of an address space execv has replaced. */
+void proc_execusage(struct addrspace *oldas);
+
+/* Get the memory usage of a process, across execs. */
+void proc_getusage(struct proc *proc, struct rusage *usage);
+
+/* Add one process's usage into a running total. */
+void proc_addusage(struct rusage *total, const struct rusage *usage);
+
+/* Print the memory usage of every process. */
+void proc_printusage(void);
+
 
 #endif /* _PROC_H_ */
@@ -0,0 +1,57 @@
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+/*
+ * Object caches for the VM system's own structures.
+ *
+ * A cache hands out objects of one type, carved from whole pages. Each
+ * cpu keeps a short list of free objects that it allocates from and
+ * frees to at splhigh without taking any lock; only when its list runs
+ * dry or grows too long does it trade a batch with the cache's shared
+ * list, under the cache's spinlock.
+ *
+ * Pages are never given back, so memory that once held an object of a
+ * cache only ever holds objects of that cache. Lock-free readers (the
+ * page table's) rely on this. A free object's link to the next free one
+ * is kept in the field named when the cache is declared, so a field
+ * such readers follow can be left alone.
+ *
+ *    SLAB_CACHE_INITIALIZER(name, type, link) - static initializer for
+ *                a cache of TYPE, using field LINK as the free list link.
+ *
+ *    slab_alloc - get an object, or NULL if out of memory. Its contents
+ *                are left over from its last use.
+ *
+ *    slab_free  - give an object back to the cache it came from.
+ */
+
+#include <spinlock.h>
+#include <platform/maxcpus.h>
+
+#define SLAB_CPU_BATCH  16      /* objects moved to/from the shared list */
+#define SLAB_CPU_MAX    32      /* per-cpu list size that triggers a drain */
+
+struct slab_cpu {
+        void *free;
+        unsigned int nfree;
+};
+
+struct slab_cache {
+        const char *sc_name;
+        size_t sc_size;                 /* object size */
+        size_t sc_link;                 /* offset of the free list link */
+        struct spinlock sc_lock;        /* protects the fields below */
+        void *sc_free;                  /* shared free list */
+        unsigned int sc_nfree;
+        unsigned int sc_pages;          /* pages carved up so far */
+        struct slab_cpu sc_cpu[MAXCPUS]; /* only touched by that cpu */
+};
+
+#define SLAB_CACHE_INITIALIZER(name, type, link) \
+        { name, sizeof(type), (size_t) &((type *) 0)->link, \
+          SPINLOCK_INITIALIZER, NULL, 0, 0, { { NULL, 0 } } }
+
+void *slab_alloc(struct slab_cache *sc);
+void slab_free(struct slab_cache *sc, void *obj);
+
+#endif /* _SLAB_H_ */
@@ -70,6 +70,9 @@ int sys_execv(userptr_t prog, userptr_t args);
 __DEAD void sys__exit(int code);
 int sys_waitpid(pid_t pid, userptr_t returncode, int flags, pid_t *retval);
 int sys_getpid(pid_t *retval);
+int sys_getrusage(int who, userptr_t usage);
+int sys_getrlimit(int resource, userptr_t rlp);
+int sys_setrlimit(int resource, const_userptr_t rlp);
 
 int sys_open(const_userptr_t filename, int flags, mode_t mode, int *retval);
 int sys_dup2(int oldfd, int newfd, int *retval);
@@ -92,4 +95,8 @@ int sys_fstat(int fd, userptr_t statptr);
 int sys_fsync(int fd);
 int sys_ftruncate(int fd, off_t len);
 
+int sys_sbrk(intptr_t amount, int32_t *retval);
+int sys_mmap(size_t length, int prot, int fd, off_t offset, int32_t *retval);
+int sys_munmap(userptr_t addr);
+
 #endif /* _SYSCALL_H_ */
@@ -30,27 +30,101 @@
 #ifndef _VM_H_
 #define _VM_H_
 
+#include "opt-ipt.h"
+
 struct addrspace;
 struct region;
+struct vnode;
 /*
  * VM system-related definitions.
  *
  * You'll probably want to add stuff here.
  */
 
+/* frame states */
+#define FRAME_FREE      0       /* on the free list */
+#define FRAME_KERNEL    1       /* kernel memory, or a user page being set up */
+#define FRAME_USER      2       /* user page, may be paged out */
+#define FRAME_EVICTING  3       /* user page being written to swap */
+
+/* buddy allocator block sizes, in powers of two frames */
+#define FRAME_MAX_ORDER 10      /* largest block is 4MB */
+#define FRAME_NO_ORDER  0xff    /* frame is not the first of a block */
+
+/* per-cpu frame caches, see frametable.c */
+#define FRAME_CACHE_BATCH 16    /* frames moved to/from the buddy lists */
+#define FRAME_CACHE_MAX   32    /* cache size that triggers a drain */
+
+/* pre-zeroed frame pool watermarks, see frametable.c */
+#define FRAME_ZERO_LOW  16      /* pool size that wakes the zeroing thread */
+#define FRAME_ZERO_HIGH 128     /* pool size it fills up to */
+
+/* pageout thread watermarks in free frames, see vm.c */
+#define PAGEOUT_LOW     32      /* free frames that wake the pageout thread */
+#define PAGEOUT_HIGH    64      /* free frames it reclaims up to */
+#define PAGEOUT_BATCH   16      /* pages it frees between yields */
+
+/*
+ * One per physical frame. Besides the allocator's state it keeps the
+ * reverse map: every page table entry mapping the frame (bar those of
+ * the zero page, which is mapped everywhere) is on its owner list,
+ * chained through rmap_next. The list and the counts are protected by
+ * the frame table's lock; the two bits are set without it.
+ */
 struct frame_table_entry {
         struct frame_table_entry *next_free_frame;
+        struct frame_table_entry *prev_free_frame;
+        unsigned int refcount;          /* references, mappings included */
+        struct page_table_entry *owners; /* mappings of the frame */
+        uint16_t mapcount;              /* entries on the owner list */
+        uint8_t state;                  /* see FRAME_* above */
+        uint8_t order;                  /* log2 size of block it heads */
+        bool referenced;                /* second chance for the clock */
+        bool dirty;                     /* mapped writable since allocated */
 };
 
+/*
+ * Hash chain links. With the inverted page table (options ipt) every
+ * entry lives in one array and chains link by index into it.
+ */
+#if OPT_IPT
+typedef uint32_t pt_link_t;
+#define PT_NIL 0xffffffff               /* end of a chain */
+#else
+typedef struct page_table_entry *pt_link_t;
+#define PT_NIL NULL
+#endif
+
 struct page_table_entry {
         uint32_t pid;                   /* process id */
         vaddr_t vpn;                    /* virtual page number */
         uint32_t elo;                   /* permissions in entrylo format */
-        struct page_table_entry *next;  /* link for collisons */
+        pt_link_t next;                 /* link for collisons */
+        struct page_table_entry *as_next; /* next page of the same as */
+        struct page_table_entry *rmap_next; /* next mapping of the frame */
+        uint32_t slot;                  /* clean copy on swap, or PTE_NOSLOT */
 };
 
+/*
+ * A page swapped back in for a read keeps its slot until it is first
+ * written, so that paging it out again while clean needs no write.
+ * Pages read back from compressed swap give the slot up at once.
+ */
+#define PTE_NOSLOT      0xffffffff      /* no copy of the page on swap */
+
+/* 
+ * Software bits in a page table entry's elo. They are never loaded into
+ * the tlb: a swapped out entry has TLBLO_VALID clear and keeps its swap
+ * slot in the TLBLO_PPAGE bits.
+ */
+#define PTE_SWAPPED     0x00000001      /* page is on swap */
+#define PTE_BUSY        0x00000002      /* page in transit to or from swap */
+#define PTE_MODIFIED    0x00000004      /* shared file page was written */
+#define PTE_SOFT        0x000000ff      /* all of the software bits */
+#define PTE_SLOT(elo)   (((elo) & TLBLO_PPAGE) >> PAGE_BITS)
+
 extern struct frame_table_entry *frame_table;
-extern struct page_table_entry **page_table;
+extern pt_link_t *page_table;
 
 #include <machine/vm.h>
 
@@ -70,14 +144,76 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
 
+/* Allocate pages without zeroing them, for callers that overwrite them */
+vaddr_t alloc_kpages_nozero(unsigned npages);
+
+/* Fault-around: the largest window, and the knob and its counters */
+#define FAULT_AROUND_MAX 16
+void vm_set_faultaround(unsigned int npages);
+void vm_print_faultaround(void);
+
+/* VM statistics, see vmstat.h */
+void vmstat_bootstrap(void);
+void vmstat_print(void);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+/* Drop every tlb entry of an address space, on every cpu */
+void vm_tlbflush(struct addrspace *as);
+
 /* Frame table functions */
 void frame_table_init(unsigned int nframes);
+void frame_zero_bootstrap(void);
+unsigned int frame_free_count(void);
+unsigned int frame_total_count(void);
+unsigned int frame_zero_count(void);
+void frame_ref(paddr_t paddr);
+unsigned int frame_refcount(paddr_t paddr);
+void frame_set_user(paddr_t paddr, struct page_table_entry *pte);
+void frame_add_owner(paddr_t paddr, struct page_table_entry *pte);
+void frame_set_referenced(paddr_t paddr);
+void frame_set_dirty(paddr_t paddr);
+bool frame_clock_select(paddr_t *paddr, struct page_table_entry **pte);
+bool frame_claim(paddr_t paddr, struct page_table_entry *pte, bool *dirty);
+void frame_disown(paddr_t paddr, struct page_table_entry *pte);
+void frame_unclaim(paddr_t paddr);
+
+/* Pageout thread functions */
+void pageout_kick(void);
 
 /* Page table functions */
 int page_table_copy(struct addrspace *oldas, struct addrspace *newas);
 void page_table_remove(struct addrspace *as);
+void page_table_remove_range(struct addrspace *as, vaddr_t start, vaddr_t end);
+int page_table_writeback(struct addrspace *as, struct region *region);
+
+/* Swap functions */
+void swap_bootstrap(unsigned int nframes);
+unsigned int swap_size(void);
+int swap_alloc(unsigned int *slot);
+void swap_free(unsigned int slot);
+int swap_read(unsigned int slot, paddr_t paddr);
+int swap_write(unsigned int slot, paddr_t paddr);
+bool swap_keepable(unsigned int slot);
+bool swap_cache_reserve(unsigned int slot);
+void swap_cache_fill(unsigned int slot, paddr_t paddr);
+paddr_t swap_cache_take(unsigned int slot);
+bool swap_cache_shrink(void);
+
+/* Read-ahead functions */
+void prefetch_bootstrap(void);
+void prefetch_file(struct vnode *v, off_t foff, unsigned int head,
+                   unsigned int len);
+void prefetch_swap(unsigned int slot);
+
+/* Page cache functions */
+paddr_t page_cache_lookup(struct vnode *v, off_t foff, unsigned int head,
+                          unsigned int len);
+paddr_t page_cache_insert(struct vnode *v, off_t foff, unsigned int head,
+                          unsigned int len, paddr_t paddr);
+bool page_cache_shrink(bool all);
+void page_cache_update(struct vnode *v, off_t start, off_t end);
+void page_cache_forget(struct vnode *v);
 
 #endif /* _VM_H_ */
@@ -0,0 +1,84 @@
+#ifndef _VMSTAT_H_
+#define _VMSTAT_H_
+
+/*
+ * Global VM counters.
+ *
+ * Every cpu bumps its own copy of the counters, with no lock and no
+ * atomic operation, and vmstat_sum adds the copies up when somebody
+ * asks. A thread that migrates between reading curcpu and storing the
+ * count can very occasionally lose an increment; that is the price of
+ * keeping them off the fault path's critical sections.
+ *
+ *    VMSTAT_INC(field)     - count one event on this cpu.
+ *
+ *    VMSTAT_ADD(field, n)  - count n of them.
+ *
+ *    vmstat_sum            - total of every cpu's counters.
+ *
+ *    vmstat_fault_done     - file a slow-path fault's latency, given
+ *                the time it started, in the log2 histogram.
+ *
+ *    page_table_chains     - hash chain lengths, walked under the
+ *                stripe locks.
+ */
+
+#include <cpu.h>
+#include <current.h>
+#include <platform/maxcpus.h>
+
+struct timespec;
+
+/* fault latency buckets: bucket i is 2^i to 2^(i+1) microseconds */
+#define VMSTAT_LAT_BUCKETS 16
+
+struct vmstat {
+        /* vm.c */
+        unsigned int tlb_misses;        /* read and write misses */
+        unsigned int tlb_readonly;      /* writes to read-only entries */
+        unsigned int faultaround_loads; /* entries preloaded */
+        unsigned int pt_hits;           /* misses a resident entry served */
+        unsigned int pt_misses;         /* faults that had to do more */
+        unsigned int pt_locks;          /* stripe lock acquisitions */
+        unsigned int pt_contended;      /* ... that found it already held */
+        unsigned int zero_maps;         /* reads mapped to the zero page */
+        unsigned int cow_copies;        /* frames copied on write */
+        unsigned int swapins;           /* pages brought back from swap */
+        unsigned int swapins_cached;    /* ... found in the swap cache */
+        unsigned int pageouts;          /* pages evicted */
+        unsigned int pageouts_clean;    /* ... with no write to swap */
+        unsigned int fault_lat[VMSTAT_LAT_BUCKETS];
+
+        /* swap.c */
+        unsigned int zswap_stores;      /* pages kept compressed in memory */
+        unsigned int zswap_loads;       /* ... and read back */
+        unsigned int disk_writes;       /* pages written to the swap disk */
+        unsigned int disk_reads;        /* ... and read back */
+
+        /* frametable.c */
+        unsigned int frame_allocs;      /* frames handed out */
+        unsigned int frame_frees;       /* frames given back */
+        unsigned int zero_fills;        /* frames zeroed on allocation */
+        unsigned int zero_pool_hits;    /* zeroed frames from the pool */
+        unsigned int cache_refills;     /* per-cpu cache batches taken */
+        unsigned int cache_drains;      /* per-cpu cache batches returned */
+};
+
+/* hash chain lengths of the page table */
+struct pt_chain_stats {
+        unsigned int buckets;           /* chains in the table */
+        unsigned int used;              /* chains with any entry */
+        unsigned int entries;           /* entries on all chains */
+        unsigned int longest;           /* entries on the longest chain */
+};
+
+extern struct vmstat vmstat_cpu[MAXCPUS];
+
+#define VMSTAT_INC(field)       (vmstat_cpu[curcpu->c_number].field++)
+#define VMSTAT_ADD(field, n)    (vmstat_cpu[curcpu->c_number].field += (n))
+
+void vmstat_sum(struct vmstat *total);
+void vmstat_fault_done(const struct timespec *start);
+void page_table_chains(struct pt_chain_stats *stats);
+
+#endif /* _VMSTAT_H_ */
@@ -33,6 +33,7 @@
 #include <spinlock.h>
 struct uio;
 struct stat;
+struct cached_page;
 
 
 /*
@@ -57,6 +58,8 @@ struct vnode {
 	void *vn_data;                  /* Filesystem-specific data */
 
 	const struct vnode_ops *vn_ops; /* Functions on this vnode */
+
+	struct cached_page *vn_pages;   /* Pages in the VM's page cache */
 };
 
 /*
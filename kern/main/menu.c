@@ -40,6 +40,7 @@
 #include <synch.h>
 #include <thread.h>
 #include <proc.h>
+#include <vm.h>
 #include <vfs.h>
 #include <sfs.h>
 #include <pid.h>
@@ -126,7 +127,7 @@ common_prog(int nargs, char **args)
 			args /* thread arg */, nargs /* thread arg */);
 	if (result) {
 		kprintf("thread_fork failed: %s\n", strerror(result));
-		proc_destroy(proc);
+		proc_unfork(proc);
 		return result;
 	}
 
@@ -500,6 +501,47 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_faultaround(int nargs, char **args)
+{
+	if (nargs == 2) {
+		vm_set_faultaround(atoi(args[1]));
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: fa [pages]\n");
+		return 0;
+	}
+
+	vm_print_faultaround();
+
+	return 0;
+}
+
+static
+int
+cmd_memusage(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	proc_printusage();
+
+	return 0;
+}
+
+static
+int
+cmd_vmstat(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vmstat_print();
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -566,6 +608,7 @@ static const char *testmenu[] = {
 	"[km2] kmalloc stress test           ",
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
+	"[km5] Buddy allocator test          ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -606,6 +649,9 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[fa] Fault-around window and stats  ",
+	"[mu] Memory usage per process       ",
+	"[vmstat] VM statistics              ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -657,6 +703,9 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "fa",         cmd_faultaround },
+	{ "mu",         cmd_memusage },
+	{ "vmstat",     cmd_vmstat },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -667,6 +716,7 @@ static struct {
 	{ "km2",	kmallocstress },
 	{ "km3",	kmalloctest3 },
 	{ "km4",	kmalloctest4 },
+	{ "km5",	kmalloctest5 },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -33,6 +33,8 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <kern/wait.h>
 #include <limits.h>
 #include <lib.h>
@@ -56,6 +58,8 @@ struct pidinfo {
 	pid_t pi_ppid;			// process id of parent thread
 	volatile bool pi_exited;	// true if thread has exited
 	int pi_exitstatus;		// status (only valid if exited)
+	struct rusage pi_usage;		// usage (only valid if exited)
+	struct proc *pi_proc;		// the process (only valid if not exited)
 	struct cv *pi_cv;		// use to wait for thread exit
 };
 
@@ -80,7 +84,7 @@ static int nprocs;			// number of allocated pids
  */
 static
 struct pidinfo *
-pidinfo_create(pid_t pid, pid_t ppid)
+pidinfo_create(pid_t pid, pid_t ppid, struct proc *proc)
 {
 	struct pidinfo *pi;
 
@@ -101,6 +105,8 @@ pidinfo_create(pid_t pid, pid_t ppid)
 	pi->pi_ppid = ppid;
 	pi->pi_exited = false;
 	pi->pi_exitstatus = 0xbeef;  /* Recognizably invalid value */
+	bzero(&pi->pi_usage, sizeof(pi->pi_usage));
+	pi->pi_proc = proc;
 
 	return pi;
 }
@@ -138,7 +144,7 @@ pid_bootstrap(void)
 		pidinfo[i] = NULL;
 	}
 
-	pidinfo[KERNEL_PID] = pidinfo_create(KERNEL_PID, INVALID_PID);
+	pidinfo[KERNEL_PID] = pidinfo_create(KERNEL_PID, INVALID_PID, NULL);
 	if (pidinfo[KERNEL_PID]==NULL) {
 		panic("Out of memory creating kernel pid data\n");
 	}
@@ -227,10 +233,10 @@ inc_nextpid(void)
 }
 
 /*
- * pid_alloc: allocate a process id.
+ * pid_alloc: allocate a process id for PROC.
  */
 int
-pid_alloc(pid_t *retval)
+pid_alloc(struct proc *proc, pid_t *retval)
 {
 	struct pidinfo *pi;
 	pid_t pid;
@@ -263,7 +269,7 @@ pid_alloc(pid_t *retval)
 
 	pid = nextpid;
 
-	pi = pidinfo_create(pid, curproc->p_pid);
+	pi = pidinfo_create(pid, curproc->p_pid, proc);
 	if (pi==NULL) {
 		lock_release(pidlock);
 		return ENOMEM;
@@ -341,7 +347,7 @@ pid_disown(pid_t theirpid)
  * subsequent reuse; thus we set curproc->p_pid to INVALID_PID.
  */
 void
-pid_setexitstatus(int status)
+pid_setexitstatus(int status, const struct rusage *usage)
 {
 	struct pidinfo *us;
 	int i;
@@ -367,6 +373,8 @@ pid_setexitstatus(int status)
 	KASSERT(us != NULL);
 
 	us->pi_exitstatus = status;
+	us->pi_usage = *usage;
+	us->pi_proc = NULL;
 	us->pi_exited = true;
 
 	if (us->pi_ppid == INVALID_PID) {
@@ -457,9 +465,34 @@ pid_wait(pid_t theirpid, int *status, int flags, pid_t *ret)
 		*ret = theirpid;
 	}
 
+	/* we waited for it, so its usage counts towards ours */
+	spinlock_acquire(&curproc->p_lock);
+	proc_addusage(&curproc->p_childusage, &them->pi_usage);
+	spinlock_release(&curproc->p_lock);
+
 	them->pi_ppid = 0;
 	pi_drop(them->pi_pid);
 
 	lock_release(pidlock);
 	return 0;
 }
+
+/*
+ * pid_foreach: call FUNC on each process that has not exited. Holding
+ * the lock keeps them from getting as far as proc_destroy.
+ */
+void
+pid_foreach(void (*func)(struct proc *proc, void *data), void *data)
+{
+	int i;
+
+	lock_acquire(pidlock);
+	for (i=0; i<PROCS_MAX; i++) {
+		if (pidinfo[i] == NULL || pidinfo[i]->pi_exited ||
+		    pidinfo[i]->pi_proc == NULL) {
+			continue;
+		}
+		func(pidinfo[i]->pi_proc, data);
+	}
+	lock_release(pidlock);
+}
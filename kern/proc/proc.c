@@ -90,6 +90,10 @@ proc_create(const char *name)
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
+	proc->p_stacklimit.rlim_cur = STACK_LIMIT;
+	proc->p_stacklimit.rlim_max = RLIM_INFINITY;
+	bzero(&proc->p_execusage, sizeof(proc->p_execusage));
+	bzero(&proc->p_childusage, sizeof(proc->p_childusage));
 
 	/* VFS fields */
 	proc->p_cwd = NULL;
@@ -224,7 +228,7 @@ proc_create_runprogram(const char *name, struct proc **ret)
 		return ENOMEM;
 	}
 	/* Get a process ID */
-	result = pid_alloc(&newproc->p_pid);
+	result = pid_alloc(newproc, &newproc->p_pid);
 	if (result) {
 		proc_destroy(newproc);
 		return result;
@@ -275,7 +279,7 @@ proc_fork(struct proc **ret)
 		return ENOMEM;
 	}
 	/* Get a process ID */
-	result = pid_alloc(&newproc->p_pid);
+	result = pid_alloc(newproc, &newproc->p_pid);
 	if (result) {
 		proc_destroy(newproc);
 		return result;
@@ -318,15 +322,16 @@ proc_fork(struct proc **ret)
 	}
 
 	/*
-	 * Lock the current process to copy its current directory.
-	 * (We don't need to lock the new process, though, as we have
-	 * the only reference to it.)
+	 * Lock the current process to copy its current directory and
+	 * stack limit. (We don't need to lock the new process, though,
+	 * as we have the only reference to it.)
 	 */
 	spinlock_acquire(&curproc->p_lock);
 	if (curproc->p_cwd != NULL) {
 		VOP_INCREF(curproc->p_cwd);
 		newproc->p_cwd = curproc->p_cwd;
 	}
+	newproc->p_stacklimit = curproc->p_stacklimit;
 	spinlock_release(&curproc->p_lock);
 
 	*ret = newproc;
@@ -351,12 +356,19 @@ void
 proc_exit(int status)
 {
 	struct proc *proc = curproc;
+	struct rusage usage;
 
 	/* The kernel isn't supposed to exit. */
 	KASSERT(proc != kproc);
 
+	/* Our parent gets our usage and our children's, if it waits. */
+	proc_getusage(proc, &usage);
+	spinlock_acquire(&proc->p_lock);
+	proc_addusage(&usage, &proc->p_childusage);
+	spinlock_release(&proc->p_lock);
+
 	/* Set exit status and wake up anyone waiting for us. */
-	pid_setexitstatus(status);
+	pid_setexitstatus(status, &usage);
 
 	/* Detach from the process and attach to the kernel process. */
 	KASSERT(curthread->t_proc == proc);
@@ -484,3 +496,126 @@ proc_setas(struct addrspace *newas)
 	spinlock_release(&proc->p_lock);
 	return oldas;
 }
+
+/*
+ * Add the counters of USAGE into TOTAL. The resident count is left
+ * alone, since only the current address space has pages resident.
+ */
+static
+void
+proc_sumusage(struct as_usage *total, const struct as_usage *usage)
+{
+	if (usage->maxrss > total->maxrss) {
+		total->maxrss = usage->maxrss;
+	}
+	total->minflt += usage->minflt;
+	total->majflt += usage->majflt;
+	total->cowflt += usage->cowflt;
+	total->nswap += usage->nswap;
+}
+
+/*
+ * Snapshot the accounting of a process: its address space's counters
+ * plus those of the images execv has replaced. Returns false if it has
+ * no address space. Holding p_lock keeps the address space alive,
+ * since it is only destroyed once proc_setas has replaced it.
+ */
+static
+bool
+proc_asusage(struct proc *proc, struct as_usage *usage)
+{
+	bool hasas;
+
+	spinlock_acquire(&proc->p_lock);
+	hasas = (proc->p_addrspace != NULL);
+	if (hasas) {
+		as_getusage(proc->p_addrspace, usage);
+		proc_sumusage(usage, &proc->p_execusage);
+	}
+	spinlock_release(&proc->p_lock);
+
+	return hasas;
+}
+
+/*
+ * Called by execv once it has replaced OLDAS for good, before it is
+ * destroyed, so that the faults and high water mark of the old image
+ * still count towards the process.
+ */
+void
+proc_execusage(struct addrspace *oldas)
+{
+	struct as_usage usage;
+	struct proc *proc = curproc;
+
+	KASSERT(proc != NULL);
+
+	as_getusage(oldas, &usage);
+
+	spinlock_acquire(&proc->p_lock);
+	proc_sumusage(&proc->p_execusage, &usage);
+	spinlock_release(&proc->p_lock);
+}
+
+/*
+ * Get the memory usage of a process (which must be the current one, or
+ * be kept from exiting) in getrusage's terms. Times are not kept.
+ */
+void
+proc_getusage(struct proc *proc, struct rusage *usage)
+{
+	struct as_usage asusage;
+
+	bzero(usage, sizeof(*usage));
+	if (!proc_asusage(proc, &asusage)) {
+		return;
+	}
+
+	usage->ru_maxrss = asusage.maxrss * (PAGE_SIZE / 1024);
+	usage->ru_minflt = asusage.minflt;
+	usage->ru_majflt = asusage.majflt;
+	usage->ru_nswap = asusage.nswap;
+}
+
+/*
+ * Add USAGE into TOTAL. The largest resident set is the largest of
+ * the two rather than the sum.
+ */
+void
+proc_addusage(struct rusage *total, const struct rusage *usage)
+{
+	if (usage->ru_maxrss > total->ru_maxrss) {
+		total->ru_maxrss = usage->ru_maxrss;
+	}
+	total->ru_minflt += usage->ru_minflt;
+	total->ru_majflt += usage->ru_majflt;
+	total->ru_nswap += usage->ru_nswap;
+}
+
+static
+void
+proc_printone(struct proc *proc, void *data)
+{
+	struct as_usage usage;
+
+	(void)data;
+
+	if (!proc_asusage(proc, &usage)) {
+		return;
+	}
+
+	kprintf("%5d %6u %6u %8u %8u %8u %8u  %s\n", (int)proc->p_pid,
+		usage.rss, usage.maxrss, usage.minflt, usage.majflt,
+		usage.cowflt, usage.nswap, proc->p_name);
+}
+
+/*
+ * Print the memory usage of every process with an address space, in
+ * pages and counts.
+ */
+void
+proc_printusage(void)
+{
+	kprintf("  PID    RSS MAXRSS   MINFLT   MAJFLT      COW    PAGED  NAME\n");
+	pid_foreach(proc_printone, NULL);
+}
@@ -45,6 +45,7 @@
 #include <copyinout.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <vm.h>
 #include <openfile.h>
 #include <filetable.h>
 #include <syscall.h>
@@ -149,6 +150,17 @@ sys_readwrite(int fd, userptr_t buf, size_t size, enum uio_rw rw,
 	result = (rw == UIO_READ) ?
 		VOP_READ(file->of_vnode, &useruio) :
 		VOP_WRITE(file->of_vnode, &useruio);
+
+	/*
+	 * Cached pages of whatever we wrote are stale now, even if the
+	 * write then failed partway. Update them before letting go of
+	 * the offset lock, so a later write to the same file can't have
+	 * its update overtaken by ours.
+	 */
+	if (rw == UIO_WRITE && locked && useruio.uio_offset > pos) {
+		page_cache_update(file->of_vnode, pos, useruio.uio_offset);
+	}
+
 	if (result) {
 		goto fail;
 	}
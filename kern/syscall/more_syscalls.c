@@ -45,6 +45,7 @@
 #include <copyinout.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <addrspace.h>
 #include <openfile.h>
 #include <filetable.h>
 #include <syscall.h>
@@ -374,6 +375,7 @@ sys_fstat(int fd, userptr_t statptr)
 int
 sys_fsync(int fd)
 {
+	struct addrspace *as;
 	struct openfile *file;
 	int err;
 
@@ -387,6 +389,16 @@ sys_fsync(int fd)
 	 * and we're not using any of its non-constant fields.
 	 */
 
+	/* first push out what was written through shared mappings */
+	as = proc_getas();
+	if (as != NULL) {
+		err = as_sync_file(as, file->of_vnode);
+		if (err) {
+			filetable_put(curproc->p_filetable, fd, file);
+			return err;
+		}
+	}
+
 	err = VOP_FSYNC(file->of_vnode);
 	filetable_put(curproc->p_filetable, fd, file);
 	return err;
@@ -399,6 +411,7 @@ int
 sys_ftruncate(int fd, off_t len)
 {
 	struct openfile *file;
+	struct stat st;
 	int err;
 
 	if (len < 0) {
@@ -423,7 +436,18 @@ sys_ftruncate(int fd, off_t len)
 	 * and we're not using any of its non-constant fields.
 	 */
 
+	/* the old size says which cached bytes a shrink takes away */
+	err = VOP_STAT(file->of_vnode, &st);
+	if (err) {
+		filetable_put(curproc->p_filetable, fd, file);
+		return err;
+	}
+
 	err = VOP_TRUNCATE(file->of_vnode, len);
+	if (!err && len < st.st_size) {
+		/* cached pages past the new end may be stale now */
+		page_cache_update(file->of_vnode, len, st.st_size);
+	}
 	filetable_put(curproc->p_filetable, fd, file);
 	return err;
 }
@@ -33,6 +33,8 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <kern/wait.h>
 #include <lib.h>
 #include <machine/trapframe.h>
@@ -157,3 +159,83 @@ sys_waitpid(pid_t pid, userptr_t retstatus, int flags, pid_t *retval)
 	}
 	return result;
 }
+
+/*
+ * sys_getrusage
+ * only the memory fields are filled in: the largest resident set, page
+ * faults and pages paged out. Children count once they are waited for.
+ */
+int
+sys_getrusage(int who, userptr_t usage)
+{
+	struct rusage ru;
+
+	switch (who) {
+	    case RUSAGE_SELF:
+		proc_getusage(curproc, &ru);
+		break;
+	    case RUSAGE_CHILDREN:
+		spinlock_acquire(&curproc->p_lock);
+		ru = curproc->p_childusage;
+		spinlock_release(&curproc->p_lock);
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	return copyout(&ru, usage, sizeof(ru));
+}
+
+/*
+ * sys_getrlimit
+ * only the stack limit is kept; the others are not enforced.
+ */
+int
+sys_getrlimit(int resource, userptr_t rlp)
+{
+	struct rlimit rl;
+
+	if (resource != RLIMIT_STACK) {
+		return EINVAL;
+	}
+
+	spinlock_acquire(&curproc->p_lock);
+	rl = curproc->p_stacklimit;
+	spinlock_release(&curproc->p_lock);
+
+	return copyout(&rl, rlp, sizeof(rl));
+}
+
+/*
+ * sys_setrlimit
+ * sets the stack limit. Anyone may lower the hard limit, but nobody
+ * may raise it again.
+ */
+int
+sys_setrlimit(int resource, const_userptr_t rlp)
+{
+	struct rlimit rl;
+	int result;
+
+	if (resource != RLIMIT_STACK) {
+		return EINVAL;
+	}
+
+	result = copyin(rlp, &rl, sizeof(rl));
+	if (result) {
+		return result;
+	}
+	if (rl.rlim_cur > rl.rlim_max) {
+		return EINVAL;
+	}
+
+	spinlock_acquire(&curproc->p_lock);
+	if (rl.rlim_max > curproc->p_stacklimit.rlim_max) {
+		spinlock_release(&curproc->p_lock);
+		return EPERM;
+	}
+	curproc->p_stacklimit = rl;
+	spinlock_release(&curproc->p_lock);
+
+	return 0;
+}
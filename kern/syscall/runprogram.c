@@ -392,6 +392,7 @@ loadexec(char *path, vaddr_t *entrypoint, vaddr_t *stackptr)
 	 * nothing left for it to return an error to.
 	 */
 	if (oldvm) {
+		proc_execusage(oldvm);
 		as_destroy(oldvm);
 	}
 
@@ -0,0 +1,98 @@
+/*
+ * Memory-related syscalls.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <openfile.h>
+#include <filetable.h>
+#include <syscall.h>
+
+/*
+ * sys_sbrk
+ * moves the break by AMOUNT bytes and hands back the old break. The
+ * address space does the real work.
+ */
+int
+sys_sbrk(intptr_t amount, int32_t *retval)
+{
+	struct addrspace *as;
+	vaddr_t oldbreak;
+	int result;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EINVAL;
+	}
+
+	result = as_sbrk(as, amount, &oldbreak);
+	if (result) {
+		return result;
+	}
+
+	*retval = (int32_t)oldbreak;
+	return 0;
+}
+
+/*
+ * sys_mmap
+ * maps part of an open file. The file must be open for reading, and for
+ * writing too if a shared mapping is to be writable.
+ */
+int
+sys_mmap(size_t length, int prot, int fd, off_t offset, int32_t *retval)
+{
+	struct addrspace *as;
+	struct openfile *file;
+	vaddr_t addr;
+	int result;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EINVAL;
+	}
+
+	result = filetable_get(curproc->p_filetable, fd, &file);
+	if (result) {
+		return result;
+	}
+
+	if (file->of_accmode == O_WRONLY ||
+	    ((prot & PROT_WRITE) && !(prot & MAP_PRIVATE) &&
+	     file->of_accmode != O_RDWR)) {
+		filetable_put(curproc->p_filetable, fd, file);
+		return EACCES;
+	}
+
+	result = as_mmap(as, length, prot, file->of_vnode, offset, &addr);
+	filetable_put(curproc->p_filetable, fd, file);
+	if (result) {
+		return result;
+	}
+
+	*retval = (int32_t)addr;
+	return 0;
+}
+
+/*
+ * sys_munmap
+ * removes a mapping made by mmap.
+ */
+int
+sys_munmap(userptr_t addr)
+{
+	struct addrspace *as;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EINVAL;
+	}
+
+	return as_munmap(as, (vaddr_t)addr);
+}
@@ -378,3 +378,123 @@ kmalloctest4(int nargs, char **args)
 	kprintf("Multipage kmalloc test done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+// km5
+
+#define KM5_FRAGS 128
+#define KM5_ORDERS 6
+
+/*
+ * Fills a block of pages with a pattern of its own address, or checks
+ * that it is still there, so that overlapping blocks show up.
+ */
+static
+void
+km5fill(vaddr_t block, unsigned npages, bool check)
+{
+	vaddr_t *words = (vaddr_t *)block;
+	unsigned i, n;
+
+	n = npages * PAGE_SIZE / sizeof(vaddr_t);
+	for (i = 0; i < n; i += 64) {
+		if (!check) {
+			words[i] = block + i;
+		}
+		else if (words[i] != block + i) {
+			panic("kmalloctest5: block 0x%lx overwritten\n",
+			      (unsigned long)block);
+		}
+	}
+}
+
+/* Returns the largest order a block can be allocated at right now */
+static
+unsigned
+km5largest(void)
+{
+	unsigned order;
+	vaddr_t block;
+
+	for (order = FRAME_MAX_ORDER; order > 0; order--) {
+		block = alloc_kpages(1U << order);
+		if (block != 0) {
+			free_kpages(block);
+			return order;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Buddy allocator test. Fragments memory by taking single pages and
+ * giving every other one back, then checks that multi-page blocks
+ * still come back whole and naturally aligned. Once everything is
+ * freed the buddies must coalesce, so the largest block that could be
+ * had at the start can be had again.
+ */
+int
+kmalloctest5(int nargs, char **args)
+{
+	vaddr_t frags[KM5_FRAGS];
+	vaddr_t blocks[KM5_ORDERS + 1];
+	unsigned i, order, largest, after;
+	paddr_t paddr;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting buddy allocator test...\n");
+#if OPT_DUMBVM
+	kprintf("(This test will not work with dumbvm)\n");
+#endif
+
+	largest = km5largest();
+	kprintf("Largest block: %u pages\n", 1U << largest);
+
+	for (i = 0; i < KM5_FRAGS; i++) {
+		frags[i] = alloc_kpages(1);
+		if (frags[i] == 0) {
+			panic("kmalloctest5: allocating page %u failed\n", i);
+		}
+		km5fill(frags[i], 1, false);
+	}
+	for (i = 0; i < KM5_FRAGS; i += 2) {
+		free_kpages(frags[i]);
+		frags[i] = 0;
+	}
+
+	for (order = 1; order <= KM5_ORDERS && order < largest; order++) {
+		blocks[order] = alloc_kpages(1U << order);
+		if (blocks[order] == 0) {
+			panic("kmalloctest5: allocating %u pages failed\n",
+			      1U << order);
+		}
+		paddr = KVADDR_TO_PADDR(blocks[order]);
+		if (paddr % ((1U << order) * PAGE_SIZE) != 0) {
+			panic("kmalloctest5: %u page block at 0x%lx is not "
+			      "aligned\n", 1U << order, (unsigned long)paddr);
+		}
+		km5fill(blocks[order], 1U << order, false);
+	}
+
+	for (i = 1; i < KM5_FRAGS; i += 2) {
+		km5fill(frags[i], 1, true);
+	}
+	for (order = 1; order <= KM5_ORDERS && order < largest; order++) {
+		km5fill(blocks[order], 1U << order, true);
+		free_kpages(blocks[order]);
+	}
+	for (i = 1; i < KM5_FRAGS; i += 2) {
+		free_kpages(frags[i]);
+	}
+
+	after = km5largest();
+	if (after < largest) {
+		panic("kmalloctest5: largest block shrank from %u to %u "
+		      "pages\n", 1U << largest, 1U << after);
+	}
+
+	kprintf("Buddy allocator test done\n");
+	return 0;
+}
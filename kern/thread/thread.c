@@ -182,6 +182,10 @@ cpu_create(unsigned hardware_number)
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
+	c->c_asid_generation = 0;
+	c->c_free_frames = NULL;
+	c->c_nfree_frames = 0;
+	spinlock_init(&c->c_frame_lock);
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
@@ -255,6 +259,21 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+/*
+ * Count the cpus, or get one by number.
+ */
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+struct cpu *
+cpu_get(unsigned num)
+{
+	return cpuarray_get(&allcpus, num);
+}
+
 /*
  * Destroy a thread.
  *
@@ -1167,6 +1186,22 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+/*
+ * Send a TLB shootdown IPI to each CPU whose number has its bit set
+ * in CPUS.
+ */
+void
+ipi_tlbshootdown_cpus(uint32_t cpus, const struct tlbshootdown *mapping)
+{
+	unsigned i;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		if (cpus & ((uint32_t)1 << i)) {
+			ipi_tlbshootdown(cpuarray_get(&allcpus, i), mapping);
+		}
+	}
+}
+
 /*
  * Handle an incoming interprocessor interrupt.
  */
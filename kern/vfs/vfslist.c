@@ -43,6 +43,7 @@
 #include <fs.h>
 #include <vnode.h>
 #include <device.h>
+#include <vm.h>
 
 /*
  * Structure for a single named device.
@@ -660,6 +661,9 @@ vfs_unmount(const char *devname)
 		goto fail;
 	}
 
+	/* give the page cache's frames back first */
+	page_cache_shrink(true);
+
 	result = FSOP_UNMOUNT(kd->kd_fs);
 	if (result) {
 		goto fail;
@@ -763,6 +767,8 @@ vfs_unmountall(void)
 			}
 		}
 
+		page_cache_shrink(true);
+
 		result = FSOP_UNMOUNT(dev->kd_fs);
 		if (result == EBUSY) {
 			kprintf("vfs: Cannot unmount %s: (busy)\n",
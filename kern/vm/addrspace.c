@@ -27,18 +27,46 @@
  * SUCH DAMAGE.
  */
 
+#define ASINLINE
+
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
 #include <current.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <slab.h>
 #include <proc.h>
+#include <vnode.h>
+#include <kern/mman.h>
+#include <kern/stat.h>
+
+/*
+ * ASID allocation. ASIDs are handed out in order and never reused
+ * within a generation; when they run out a new generation starts and
+ * every cpu flushes its tlb before it next activates an address space,
+ * so no entry from an older generation can match again. An address
+ * space whose as->asid is from an older generation (or 0, never set)
+ * gets a new ASID when it is next activated. as->tlb_cpus collects the
+ * cpus the address space has been activated on under its current ASID,
+ * which are the only ones a tlb shootdown (see vm.c) needs to reach.
+ */
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+static uint32_t asid_generation = NUM_ASID;
+static uint32_t asid_next = 0;
 
-#define STACK_PAGES 16
+/*
+ * Regions and address spaces come from object caches (see slab.h), as
+ * every fork and exec makes and frees a batch of them.
+ */
+static struct slab_cache region_cache =
+        SLAB_CACHE_INITIALIZER("region", struct region, vnode);
+static struct slab_cache as_cache =
+        SLAB_CACHE_INITIALIZER("addrspace", struct addrspace, heap);
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -50,12 +78,135 @@
  *
  */
 
+/*
+ * Index of the last region with vbase <= VADDR, or -1 if there is none.
+ * Regions with equal bases stay in the order they were made.
+ */
+static int
+region_search(struct addrspace *as, vaddr_t vaddr)
+{
+        int lo, hi, mid;
+
+        lo = 0;
+        hi = regionarray_num(&as->regions);
+        while (lo < hi) {
+                mid = (lo + hi) / 2;
+                if (regionarray_get(&as->regions, mid)->vbase <= vaddr) {
+                        lo = mid + 1;
+                }
+                else {
+                        hi = mid;
+                }
+        }
+
+        return lo - 1;
+}
+
+/*
+ * Makes a region and slots it into the sorted array, handing it back
+ * in RET so callers can fill in the rest.
+ */
+static int
+region_create(struct addrspace *as, vaddr_t vaddr, size_t memsize,
+              int accmode, struct region **ret)
+{
+        int result;
+        unsigned i, pos;
+        struct region *curr;
+
+        /*
+         * align the region, keeping the offset into the first page so
+         * an unaligned segment's tail is still covered
+         */
+        memsize = ROUNDUP(memsize + (vaddr & ~PAGE_FRAME), PAGE_SIZE);
+        vaddr &= PAGE_FRAME;
+
+        curr = slab_alloc(&region_cache);
+        if (curr == NULL) {
+                return ENOMEM;
+        }
+
+        curr->vbase = vaddr;
+        curr->size = memsize;
+        curr->accmode = accmode;
+        curr->vnode = NULL;
+        curr->filebase = 0;
+        curr->offset = 0;
+        curr->filesize = 0;
+        curr->ra_next = 0;
+        curr->ra_run = 0;
+        curr->ra_end = 0;
+
+        pos = region_search(as, vaddr) + 1;
+        result = regionarray_setsize(&as->regions,
+                                     regionarray_num(&as->regions) + 1);
+        if (result) {
+                slab_free(&region_cache, curr);
+                return result;
+        }
+        for (i = regionarray_num(&as->regions) - 1; i > pos; i--) {
+                regionarray_set(&as->regions, i,
+                                regionarray_get(&as->regions, i - 1));
+        }
+        regionarray_set(&as->regions, pos, curr);
+
+        *ret = curr;
+        return 0; 
+}
+
+/* Takes the region at index I out of the array and frees it */
+static void
+region_destroy(struct addrspace *as, unsigned i)
+{
+        struct region *curr;
+
+        curr = regionarray_get(&as->regions, i);
+        regionarray_remove(&as->regions, i);
+        if (as->last_region == curr) {
+                as->last_region = NULL;
+        }
+        if (curr->vnode != NULL) {
+                VOP_DECREF(curr->vnode);
+        }
+        slab_free(&region_cache, curr);
+}
+
+/*
+ * Returns true if [vaddr, vaddr + size) overlaps any region, handing
+ * back the highest region in the way.
+ */
+static bool
+as_overlaps(struct addrspace *as, vaddr_t vaddr, size_t size, 
+            struct region **hit)
+{
+        int i, below;
+        struct region *curr;
+
+        /* only the regions starting below vaddr that share a page reach */
+        below = 0;
+        for (i = region_search(as, vaddr + size - 1); i >= 0; i--) {
+                curr = regionarray_get(&as->regions, i);
+                if (curr->size == 0) {
+                        continue;
+                }
+                if (curr->vbase + curr->size > vaddr) {
+                        *hit = curr;
+                        return true;
+                }
+                if (curr->vbase < vaddr && ++below == 2) {
+                        break;
+                }
+        }
+
+        return false;
+}
+
 struct addrspace *
 as_create(void)
 {
         struct addrspace *as;
 
-        as = kmalloc(sizeof(struct addrspace));
+        as = slab_alloc(&as_cache);
         if (as == NULL) {
                 return NULL;
         }
@@ -63,7 +214,16 @@ as_create(void)
         /*
          * Initialize as needed.
          */
-        as->regions = NULL;
+        regionarray_init(&as->regions);
+        as->last_region = NULL;
+        as->heap = NULL;
+        as->stack = NULL;
+        as->heap_end = 0;
+        as->pages = NULL;
+        as->asid = 0;
+        as->tlb_cpus = 0;
+        spinlock_init(&as->usage_lock);
+        bzero(&as->usage, sizeof(as->usage));
         as->load = false;
 
         return as;
@@ -73,8 +233,9 @@ int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
         int result;
+        unsigned i;
         struct addrspace *newas;
-        struct region *curr;
+        struct region *curr, *copy;
 
         newas = as_create();
         if (newas == NULL) {
@@ -82,21 +243,40 @@ as_copy(struct addrspace *old, struct addrspace **ret)
         }
 
         /* add regions from old to new */
-        for (curr = old->regions; curr != NULL; curr = curr->next) {
-                result = as_define_region(newas, 
-                                        curr->vbase, 
-                                        curr->size, 
-                                        curr->accmode & RGN_R, 
-                                        curr->accmode & RGN_W,
-                                        curr->accmode & RGN_X);
+        for (i = 0; i < regionarray_num(&old->regions); i++) {
+                curr = regionarray_get(&old->regions, i);
+                result = region_create(newas, curr->vbase, curr->size,
+                                       curr->accmode, &copy);
                 if (result) {
                         as_destroy(newas);
                         return result;
                 }
+
+                if (curr == old->heap) {
+                        newas->heap = copy;
+                }
+                if (curr == old->stack) {
+                        newas->stack = copy;
+                }
+
+                if (curr->vnode != NULL) {
+                        VOP_INCREF(curr->vnode);
+                        copy->vnode = curr->vnode;
+                        copy->filebase = curr->filebase;
+                        copy->offset = curr->offset;
+                        copy->filesize = curr->filesize;
+                }
         }
 
-        /* copy old page table entries to new ones */
+        newas->heap_end = old->heap_end;
+
+        /* 
+         * share old page table entries copy-on-write with new ones.
+         * old's writable translations may still be in the tlbs, even
+         * if only some of its pages were shared before it failed.
+         */
         result = page_table_copy(old, newas);
+        vm_tlbflush(old);
         if (result) {
                 as_destroy(newas);
                 return result;
@@ -113,18 +293,31 @@ as_destroy(struct addrspace *as)
          * Clean up as needed.
          */
 
-        struct region *curr, *next; 
+        unsigned i;
+        struct region *curr;
 
-        curr = as->regions;
-        while (curr != NULL) {
-                next = curr->next;
-                kfree(curr);
-                curr = next;
+        /* changes to shared mappings survive the process */
+        for (i = 0; i < regionarray_num(&as->regions); i++) {
+                curr = regionarray_get(&as->regions, i);
+                if ((curr->accmode & RGN_SHARED) && curr->vnode != NULL) {
+                        page_table_writeback(as, curr);
+                }
         }
 
+        for (i = 0; i < regionarray_num(&as->regions); i++) {
+                curr = regionarray_get(&as->regions, i);
+                if (curr->vnode != NULL) {
+                        VOP_DECREF(curr->vnode);
+                }
+                slab_free(&region_cache, curr);
+        }
+        regionarray_setsize(&as->regions, 0);
+        regionarray_cleanup(&as->regions);
+
         page_table_remove(as);
 
-        kfree(as);
+        spinlock_cleanup(&as->usage_lock);
+        slab_free(&as_cache, as);
 }
 
 void
@@ -140,23 +333,60 @@ as_activate(void)
 
         /* Disable interrupts on this CPU while frobbing the TLB. */
         spl = splhigh();
+        spinlock_acquire(&asid_lock);
+
+        if ((as->asid & ~(NUM_ASID - 1)) != asid_generation) {
+                if (asid_next == NUM_ASID) {
+                        asid_generation += NUM_ASID;
+                        if (asid_generation == 0) {
+                                asid_generation = NUM_ASID;
+                        }
+                        asid_next = 0;
+                }
+                as->asid = asid_generation | asid_next++;
 
-        for (i=0; i<NUM_TLB; i++) {
-                tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+                /* nobody holds entries under the new ASID yet */
+                as->tlb_cpus = 0;
+        }
+        as->tlb_cpus |= (uint32_t) 1 << curcpu->c_number;
+
+        /* only flush when this cpu still holds an older generation */
+        if (curcpu->c_asid_generation != asid_generation) {
+                for (i=0; i<NUM_TLB; i++) {
+                        tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+                }
+                curcpu->c_asid_generation = asid_generation;
         }
 
+        spinlock_release(&asid_lock);
+
+        tlb_setasid(as->asid & (NUM_ASID - 1));
+
         splx(spl);
 }
 
+uint32_t
+as_tlb_cpus(struct addrspace *as, uint32_t *asid)
+{
+        uint32_t cpus;
+
+        spinlock_acquire(&asid_lock);
+        *asid = as->asid;
+        cpus = as->tlb_cpus;
+        spinlock_release(&asid_lock);
+
+        return cpus;
+}
+
 void
 as_deactivate(void)
 {
         /*
-         * Write this. For many designs it won't need to actually do
-         * anything. See proc.c for an explanation of why it (might)
-         * be needed.
+         * Nothing to do: entries of other address spaces are tagged
+         * with their own ASIDs and will not match, and a destroyed
+         * address space's ASID is not handed out again until the tlb
+         * has been flushed.
          */
-        as_activate();
 }
 
 /*
@@ -175,23 +405,95 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 {
         struct region *curr;
 
-        /* align the region */
-        vaddr &= PAGE_FRAME;
-        memsize = ROUNDUP(memsize, PAGE_SIZE);
+        return region_create(as, vaddr, memsize,
+                             readable | writeable | executable, &curr);
+}
 
-        curr = kmalloc(sizeof(struct region));
-        if (curr == NULL) {
-                return ENOMEM;
+/*
+ * Finds the region holding VADDR. Faults tend to come in runs on the
+ * same region, so the last region found is tried before searching.
+ */
+struct region *
+as_find_region(struct addrspace *as, vaddr_t vaddr)
+{
+        int i, end;
+        struct region *curr;
+
+        curr = as->last_region;
+        if (curr != NULL && vaddr >= curr->vbase &&
+            vaddr < curr->vbase + curr->size) {
+                return curr;
         }
 
-        curr->vbase = vaddr;
-        curr->size = memsize;
-        curr->accmode = readable | writeable | executable;
+        /* segments sharing a page overlap, so try the one before too */
+        i = region_search(as, vaddr);
+        for (end = i - 1; i >= 0 && i >= end; i--) {
+                curr = regionarray_get(&as->regions, i);
+                if (vaddr < curr->vbase + curr->size) {
+                        as->last_region = curr;
+                        return curr;
+                }
+        }
 
-        curr->next = as->regions;
-        as->regions = curr;
+        return NULL;
+}
 
-        return 0; 
+/*
+ * Collects into REGIONS (room for AS_PAGE_REGIONS) the regions holding
+ * any of the page at VADDR. Region bases are page aligned, so only the
+ * region the search finds and the ones just before it in the array can
+ * reach into the page, and the walk stops at the first that does not.
+ */
+unsigned
+as_page_regions(struct addrspace *as, vaddr_t vaddr, struct region **regions)
+{
+        int i;
+        unsigned n;
+        struct region *curr;
+
+        vaddr &= PAGE_FRAME;
+        n = 0;
+        for (i = region_search(as, vaddr); i >= 0 && n < AS_PAGE_REGIONS;
+             i--) {
+                curr = regionarray_get(&as->regions, i);
+                if (curr->size == 0) {
+                        /* an empty heap holds nothing */
+                        continue;
+                }
+                if (vaddr >= curr->vbase + curr->size) {
+                        break;
+                }
+                regions[n++] = curr;
+        }
+
+        return n;
+}
+
+/*
+ * Backs the region holding VADDR with FILESIZE bytes of the file V from 
+ * OFFSET onwards, placed at VADDR. Nothing is read now: vm_fault reads
+ * each page in when it is first touched, and zero fills the rest of the
+ * region. The region keeps a reference to the vnode.
+ */
+int
+as_define_file(struct addrspace *as, vaddr_t vaddr, struct vnode *v,
+               off_t offset, size_t filesize)
+{
+        struct region *curr;
+
+        curr = as_find_region(as, vaddr);
+        if (curr == NULL || curr->vnode != NULL ||
+            filesize > curr->vbase + curr->size - vaddr) {
+                return EINVAL;
+        }
+
+        VOP_INCREF(v);
+        curr->vnode = v;
+        curr->filebase = vaddr;
+        curr->offset = offset;
+        curr->filesize = filesize;
+
+        return 0;
 }
 
 int
@@ -204,8 +506,30 @@ as_prepare_load(struct addrspace *as)
 int
 as_complete_load(struct addrspace *as)
 {
+        int result;
+        unsigned i;
+        vaddr_t top;
+        struct region *curr;
+
         as->load = false;
-        as_activate();
+
+        /* the heap starts out empty, just past the end of the program */
+        top = 0;
+        for (i = 0; i < regionarray_num(&as->regions); i++) {
+                curr = regionarray_get(&as->regions, i);
+                if (curr->vbase + curr->size > top) {
+                        top = curr->vbase + curr->size;
+                }
+        }
+
+        result = region_create(as, top, 0, RGN_R | RGN_W, &as->heap);
+        if (result) {
+                return result;
+        }
+        as->heap_end = top;
+
+        /* drop the writable entries made while loading */
+        vm_tlbflush(as);
         return 0;
 }
 
@@ -216,11 +540,246 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 
         /* Initial user-level stack pointer */
         *stackptr = USERSTACK;
-        result = as_define_region(as, 
-                                USERSTACK - STACK_PAGES * PAGE_SIZE, 
-                                STACK_PAGES * PAGE_SIZE, 
-                                RGN_R, RGN_W, 0);
+        result = region_create(as, 
+                               USERSTACK - STACK_INIT_PAGES * PAGE_SIZE, 
+                               STACK_INIT_PAGES * PAGE_SIZE, 
+                               RGN_R | RGN_W, &as->stack);
 
         return result;
 }
 
+/*
+ * Grows the stack down to the page holding VADDR. Any fault between the
+ * stack and the limit counts, so a function with a big frame can touch
+ * the far end of it first; the pages in between are still only made as
+ * they are touched.
+ */
+int
+as_grow_stack(struct addrspace *as, vaddr_t vaddr)
+{
+        vaddr_t vbase;
+        rlim_t limit;
+        struct region *hit;
+
+        if (as->stack == NULL || vaddr >= as->stack->vbase) {
+                return EFAULT;
+        }
+
+        spinlock_acquire(&curproc->p_lock);
+        limit = curproc->p_stacklimit.rlim_cur;
+        spinlock_release(&curproc->p_lock);
+        if (limit > STACK_MAX) {
+                limit = STACK_MAX;
+        }
+
+        vbase = vaddr & PAGE_FRAME;
+        if (vbase < USERSTACK - (vaddr_t) limit) {
+                return EFAULT;
+        }
+
+        /* keep the guard gap clear of everything below */
+        if (as_overlaps(as, vbase - STACK_GUARD,
+                        as->stack->vbase - (vbase - STACK_GUARD), &hit)) {
+                return EFAULT;
+        }
+
+        as->stack->size += as->stack->vbase - vbase;
+        as->stack->vbase = vbase;
+
+        return 0;
+}
+
+
+/*
+ * Moves the break. Growing only extends the heap region, its pages are
+ * zero filled as they are first touched; shrinking frees the pages past
+ * the new end of the heap straight away.
+ */
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+        unsigned i;
+        vaddr_t newbreak, newtop, bottom;
+        struct region *curr;
+
+        if (as->heap == NULL) {
+                return EINVAL;
+        }
+
+        newbreak = as->heap_end + amount;
+        if (amount < 0 && (newbreak < as->heap->vbase || 
+                           newbreak > as->heap_end)) {
+                return EINVAL;
+        }
+        if (amount > 0 && (newbreak < as->heap_end || 
+                           newbreak > USERSPACETOP)) {
+                return ENOMEM;
+        }
+
+        newtop = ROUNDUP(newbreak, PAGE_SIZE);
+
+        /* the heap may not run into any other region, or the stack's guard */
+        for (i = 0; i < regionarray_num(&as->regions); i++) {
+                curr = regionarray_get(&as->regions, i);
+                bottom = curr->vbase;
+                if (curr == as->stack) {
+                        bottom -= STACK_GUARD;
+                }
+                if (curr != as->heap && curr->size > 0 &&
+                    bottom < newtop && 
+                    curr->vbase + curr->size > as->heap->vbase) {
+                        return ENOMEM;
+                }
+        }
+
+        if (newtop < as->heap->vbase + as->heap->size) {
+                page_table_remove_range(as, newtop, 
+                                        as->heap->vbase + as->heap->size);
+        }
+
+        as->heap->size = newtop - as->heap->vbase;
+        *oldbreak = as->heap_end;
+        as->heap_end = newbreak;
+
+        return 0;
+}
+
+/*
+ * Maps LENGTH bytes of V from OFFSET into the highest gap below MMAP_TOP
+ * that will hold them. Like the executable, the mapping is backed by the
+ * file with as_define_file and read in page by page on first touch; the
+ * part past the end of the file reads as zero and is never written back.
+ * Every mapping is readable; PROT_EXEC needs nothing more, since the
+ * tlb has no execute bit.
+ */
+int
+as_mmap(struct addrspace *as, size_t length, int prot, struct vnode *v,
+        off_t offset, vaddr_t *addr)
+{
+        int result;
+        size_t filesize;
+        vaddr_t vaddr, bottom;
+        struct stat st;
+        struct region *curr, *hit;
+
+        if (length == 0 || offset < 0 || (offset % PAGE_SIZE) != 0 ||
+            (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC | MAP_PRIVATE))) {
+                return EINVAL;
+        }
+        length = ROUNDUP(length, PAGE_SIZE);
+        if (length == 0 || length > MMAP_TOP) {
+                return ENOMEM;
+        }
+
+        result = VOP_MMAP(v);
+        if (result) {
+                return result;
+        }
+
+        result = VOP_STAT(v, &st);
+        if (result) {
+                return result;
+        }
+        filesize = 0;
+        if (offset < st.st_size) {
+                filesize = length;
+                if ((off_t) filesize > st.st_size - offset) {
+                        filesize = st.st_size - offset;
+                }
+        }
+
+        /* find a gap, working down past anything in the way */
+        bottom = (as->heap != NULL) ? as->heap->vbase + as->heap->size : 0;
+        vaddr = MMAP_TOP - length;
+        while (as_overlaps(as, vaddr, length, &hit)) {
+                if (hit->vbase < bottom + length) {
+                        return ENOMEM;
+                }
+                vaddr = hit->vbase - length;
+        }
+        if (vaddr < bottom) {
+                return ENOMEM;
+        }
+
+        result = region_create(as, vaddr, length, RGN_R | RGN_MMAP |
+                               ((prot & PROT_WRITE) ? RGN_W : 0) |
+                               ((prot & MAP_PRIVATE) ? 0 : RGN_SHARED),
+                               &curr);
+        if (result) {
+                return result;
+        }
+
+        if (filesize > 0) {
+                result = as_define_file(as, vaddr, v, offset, filesize);
+                if (result) {
+                        region_destroy(as, region_search(as, vaddr));
+                        return result;
+                }
+        }
+
+        *addr = vaddr;
+        return 0;
+}
+
+/*
+ * Removes the mapping starting at ADDR, writing back what was written
+ * to it if it is shared, and frees its pages.
+ */
+int
+as_munmap(struct addrspace *as, vaddr_t addr)
+{
+        int result, i;
+        struct region *curr;
+
+        /* mappings do not share pages, so only one can start at addr */
+        i = region_search(as, addr);
+        if (i < 0) {
+                return EINVAL;
+        }
+        curr = regionarray_get(&as->regions, i);
+        if (curr->vbase != addr || !(curr->accmode & RGN_MMAP)) {
+                return EINVAL;
+        }
+
+        if ((curr->accmode & RGN_SHARED) && curr->vnode != NULL) {
+                result = page_table_writeback(as, curr);
+                if (result) {
+                        return result;
+                }
+        }
+
+        page_table_remove_range(as, curr->vbase, curr->vbase + curr->size);
+
+        region_destroy(as, i);
+
+        return 0;
+}
+
+/* Writes back the changes made through shared mappings of V */
+int
+as_sync_file(struct addrspace *as, struct vnode *v)
+{
+        int result;
+        unsigned i;
+        struct region *curr;
+
+        for (i = 0; i < regionarray_num(&as->regions); i++) {
+                curr = regionarray_get(&as->regions, i);
+                if ((curr->accmode & RGN_SHARED) && curr->vnode == v) {
+                        result = page_table_writeback(as, curr);
+                        if (result) {
+                                return result;
+                        }
+                }
+        }
+
+        return 0;
+}
+
+void
+as_getusage(struct addrspace *as, struct as_usage *usage)
+{
+        spinlock_acquire(&as->usage_lock);
+        *usage = as->usage;
+        spinlock_release(&as->usage_lock);
+}
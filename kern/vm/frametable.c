@@ -1,9 +1,14 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <wchan.h>
 #include <thread.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <vmstat.h>
 
 /* Place your frametable data-structures here 
  * You probably also want to write a frametable initialisation
@@ -11,40 +16,503 @@
  */
 
 struct frame_table_entry *frame_table = NULL;
-static struct frame_table_entry *free_frame_ptr = NULL;
+
+/*
+ * Buddy free lists: free_lists[k] holds the free blocks of 2^k frames,
+ * each block naturally aligned to its size. Only the first frame of a 
+ * block (free or allocated) records the block's order, the remaining 
+ * frames are marked FRAME_NO_ORDER.
+ */
+static struct frame_table_entry *free_lists[FRAME_MAX_ORDER + 1];
+static unsigned int free_list_frames = 0;       /* frames on the lists */
 
 static struct spinlock mem_lock = SPINLOCK_INITIALIZER;
 
+/* 
+ * Free frames zeroed ahead of time by the pagezero thread. Like cached
+ * frames they are free but head no block.
+ */
+static struct frame_table_entry *zero_pool = NULL;
+static unsigned int zero_pool_count = 0;
+static unsigned int zero_pool_low = 0;
+static unsigned int zero_pool_high = 0;
+static struct wchan *zero_wchan = NULL;
+static struct spinlock zero_lock = SPINLOCK_INITIALIZER;
+
+/* range of frames managed by the table, and the page replacement clock */
+static unsigned int first_frame = 0;
+static unsigned int total_frames = 0;
+static unsigned int clock_hand = 0;
+
+static void free_list_push(struct frame_table_entry *fte, unsigned int order)
+{
+        fte->order = order;
+        fte->state = FRAME_FREE;
+        fte->prev_free_frame = NULL;
+        fte->next_free_frame = free_lists[order];
+        if (free_lists[order] != NULL) {
+                free_lists[order]->prev_free_frame = fte;
+        }
+        free_lists[order] = fte;
+}
+
+static void free_list_remove(struct frame_table_entry *fte)
+{
+        if (fte->prev_free_frame != NULL) {
+                fte->prev_free_frame->next_free_frame = fte->next_free_frame;
+        }
+        else {
+                free_lists[fte->order] = fte->next_free_frame;
+        }
+        if (fte->next_free_frame != NULL) {
+                fte->next_free_frame->prev_free_frame = fte->prev_free_frame;
+        }
+        fte->next_free_frame = NULL;
+        fte->prev_free_frame = NULL;
+}
+
+/* 
+ * Returns the block of 2^order frames starting at index to the free 
+ * lists, merging it with its buddy for as long as the buddy is free too.
+ */
+static void buddy_free(unsigned int index, unsigned int order)
+{
+        unsigned int i;
+        unsigned int buddy;
+
+        for (i = index; i < index + (1U << order); i++) {
+                frame_table[i].state = FRAME_FREE;
+                frame_table[i].refcount = 0;
+                frame_table[i].owners = NULL;
+                frame_table[i].mapcount = 0;
+                frame_table[i].order = FRAME_NO_ORDER;
+        }
+        free_list_frames += 1U << order;
+
+        while (order < FRAME_MAX_ORDER) {
+                buddy = index ^ (1U << order);
+                if (buddy < first_frame || buddy >= total_frames ||
+                    frame_table[buddy].state != FRAME_FREE ||
+                    frame_table[buddy].order != order) {
+                        break;
+                }
+
+                free_list_remove(&frame_table[buddy]);
+                frame_table[buddy].order = FRAME_NO_ORDER;
+                if (buddy < index) {
+                        index = buddy;
+                }
+                order++;
+        }
+
+        free_list_push(&frame_table[index], order);
+}
+
+/* 
+ * Takes a block of 2^order frames off the free lists, splitting a larger
+ * block if need be. Returns the index of its first frame, or 0 (always a
+ * kernel frame) if there is no block big enough.
+ */
+static unsigned int buddy_alloc(unsigned int order)
+{
+        unsigned int i;
+        unsigned int k;
+        unsigned int index;
+
+        for (k = order; k <= FRAME_MAX_ORDER; k++) {
+                if (free_lists[k] != NULL) {
+                        break;
+                }
+        }
+        if (k > FRAME_MAX_ORDER) {
+                return 0;
+        }
+
+        index = free_lists[k] - frame_table;
+        free_list_remove(&frame_table[index]);
+        free_list_frames -= 1U << order;
+
+        /* hand the unused upper halves back */
+        while (k > order) {
+                k--;
+                free_list_push(&frame_table[index + (1U << k)], k);
+        }
+
+        for (i = index; i < index + (1U << order); i++) {
+                frame_table[i].refcount = 1;
+                frame_table[i].state = FRAME_KERNEL;
+                frame_table[i].order = FRAME_NO_ORDER;
+                frame_table[i].referenced = false;
+                frame_table[i].dirty = false;
+        }
+        frame_table[index].order = order;
+
+        return index;
+}
+
+/* Wakes the pagezero thread if the pool has run low */
+static void zero_pool_kick(void)
+{
+        spinlock_acquire(&zero_lock);
+        if (zero_wchan != NULL && zero_pool_count < zero_pool_low) {
+                wchan_wakeone(zero_wchan, &zero_lock);
+        }
+        spinlock_release(&zero_lock);
+}
+
+/* Takes an already zeroed frame from the pool, returns 0 if it is empty */
+static unsigned int zero_pool_get(void)
+{
+        struct frame_table_entry *fte;
+
+        spinlock_acquire(&zero_lock);
+
+        fte = zero_pool;
+        if (fte != NULL) {
+                zero_pool = fte->next_free_frame;
+                zero_pool_count--;
+        }
+        if (zero_wchan != NULL && zero_pool_count < zero_pool_low) {
+                wchan_wakeone(zero_wchan, &zero_lock);
+        }
+
+        spinlock_release(&zero_lock);
+
+        if (fte == NULL) {
+                return 0;
+        }
+
+        fte->next_free_frame = NULL;
+        fte->refcount = 1;
+        fte->state = FRAME_KERNEL;
+        fte->order = 0;
+        fte->referenced = false;
+        fte->dirty = false;
+
+        return fte - frame_table;
+}
+
+/* 
+ * Gives every pooled frame back to the buddy lists, so that they can be
+ * merged into a larger block. Returns true if there were any.
+ */
+static bool zero_pool_flush(void)
+{
+        struct frame_table_entry *pool, *fte;
+
+        spinlock_acquire(&zero_lock);
+        pool = zero_pool;
+        zero_pool = NULL;
+        zero_pool_count = 0;
+        spinlock_release(&zero_lock);
+
+        if (pool == NULL) {
+                return false;
+        }
+
+        spinlock_acquire(&mem_lock);
+        while (pool != NULL) {
+                fte = pool;
+                pool = fte->next_free_frame;
+                fte->next_free_frame = NULL;
+                buddy_free(fte - frame_table, 0);
+        }
+        spinlock_release(&mem_lock);
+
+        return true;
+}
+
+/*
+ * The pagezero thread. Zeroes free frames into the pool until it holds
+ * zero_pool_high of them, then sleeps until allocations take it below
+ * zero_pool_low. It yields after every page so that it only really 
+ * gets to run when nothing else wants the cpu.
+ */
+static void zero_pool_thread(void *data1, unsigned long data2)
+{
+        unsigned int index;
+        struct frame_table_entry *fte;
+
+        (void) data1;
+        (void) data2;
+
+        while (true) {
+                spinlock_acquire(&zero_lock);
+                if (zero_pool_count >= zero_pool_high) {
+                        while (zero_pool_count >= zero_pool_low) {
+                                wchan_sleep(zero_wchan, &zero_lock);
+                        }
+                }
+                spinlock_release(&zero_lock);
+
+                spinlock_acquire(&mem_lock);
+                index = buddy_alloc(0);
+                spinlock_release(&mem_lock);
+
+                /* memory is tight, wait for frees to come back */
+                if (index == 0) {
+                        spinlock_acquire(&zero_lock);
+                        wchan_sleep(zero_wchan, &zero_lock);
+                        spinlock_release(&zero_lock);
+                        continue;
+                }
+
+                bzero((void *) PADDR_TO_KVADDR(index * PAGE_SIZE), PAGE_SIZE);
+
+                fte = &frame_table[index];
+                fte->refcount = 0;
+                fte->state = FRAME_FREE;
+                fte->order = FRAME_NO_ORDER;
+
+                spinlock_acquire(&zero_lock);
+                fte->next_free_frame = zero_pool;
+                zero_pool = fte;
+                zero_pool_count++;
+                spinlock_release(&zero_lock);
+
+                thread_yield();
+        }
+}
+
+/* Starts the pagezero thread, once threads can be forked */
+void frame_zero_bootstrap(void)
+{
+        int result;
+
+        zero_wchan = wchan_create("pagezero");
+        if (zero_wchan == NULL) {
+                panic("frame_zero_bootstrap: out of memory\n");
+        }
+
+        /* don't let the pool hoard a small machine's memory */
+        zero_pool_high = (total_frames - first_frame) / 16;
+        if (zero_pool_high > FRAME_ZERO_HIGH) {
+                zero_pool_high = FRAME_ZERO_HIGH;
+        }
+        zero_pool_low = zero_pool_high / 2;
+        if (zero_pool_low > FRAME_ZERO_LOW) {
+                zero_pool_low = FRAME_ZERO_LOW;
+        }
+
+        result = thread_fork("pagezero", NULL, zero_pool_thread, NULL, 0);
+        if (result) {
+                panic("frame_zero_bootstrap: thread_fork failed: %s\n",
+                      strerror(result));
+        }
+}
+
+/*
+ * Per-cpu frame caches. Single frames are allocated from and freed to
+ * the current cpu's cache without taking mem_lock, and the cache
+ * refills from and drains to the buddy lists FRAME_CACHE_BATCH frames
+ * at a time. Cached frames are free but head no block, so the buddy
+ * allocator never merges them. Each cache has its own lock, which only
+ * its cpu takes until memory runs out and frame_cache_reclaim empties
+ * every cache into the buddy lists.
+ */
+static bool frame_cache_reclaim(void);
+
+static unsigned int frame_cache_alloc(void)
+{
+        int spl;
+        unsigned int i;
+        unsigned int index;
+        bool reclaimed;
+        struct cpu *c;
+        struct frame_table_entry *fte;
+
+        reclaimed = false;
+        while (true) {
+                spl = splhigh();
+                c = curcpu->c_self;
+                spinlock_acquire(&c->c_frame_lock);
+
+                if (c->c_nfree_frames == 0) {
+                        VMSTAT_INC(cache_refills);
+                        spinlock_acquire(&mem_lock);
+                        for (i = 0; i < FRAME_CACHE_BATCH; i++) {
+                                index = buddy_alloc(0);
+                                if (index == 0) {
+                                        break;
+                                }
+                                fte = &frame_table[index];
+                                fte->refcount = 0;
+                                fte->state = FRAME_FREE;
+                                fte->order = FRAME_NO_ORDER;
+                                fte->next_free_frame = c->c_free_frames;
+                                c->c_free_frames = fte;
+                                c->c_nfree_frames++;
+                        }
+                        spinlock_release(&mem_lock);
+                }
+
+                fte = c->c_free_frames;
+                if (fte != NULL) {
+                        break;
+                }
+                spinlock_release(&c->c_frame_lock);
+                splx(spl);
+
+                /* other cpus may be sitting on free frames */
+                if (reclaimed || !frame_cache_reclaim()) {
+                        return 0;
+                }
+                reclaimed = true;
+        }
+
+        c->c_free_frames = fte->next_free_frame;
+        c->c_nfree_frames--;
+
+        fte->next_free_frame = NULL;
+        fte->refcount = 1;
+        fte->state = FRAME_KERNEL;
+        fte->order = 0;
+        fte->referenced = false;
+        fte->dirty = false;
+
+        spinlock_release(&c->c_frame_lock);
+        splx(spl);
+
+        return fte - frame_table;
+}
+
+static void frame_cache_free(struct frame_table_entry *fte)
+{
+        int spl;
+        unsigned int i;
+        bool drained;
+        struct cpu *c;
+
+        spl = splhigh();
+        c = curcpu->c_self;
+        spinlock_acquire(&c->c_frame_lock);
+
+        fte->refcount = 0;
+        fte->state = FRAME_FREE;
+        fte->owners = NULL;
+        fte->mapcount = 0;
+        fte->order = FRAME_NO_ORDER;
+        fte->next_free_frame = c->c_free_frames;
+        c->c_free_frames = fte;
+        c->c_nfree_frames++;
+
+        drained = false;
+        if (c->c_nfree_frames > FRAME_CACHE_MAX) {
+                VMSTAT_INC(cache_drains);
+                spinlock_acquire(&mem_lock);
+                for (i = 0; i < FRAME_CACHE_BATCH; i++) {
+                        fte = c->c_free_frames;
+                        c->c_free_frames = fte->next_free_frame;
+                        c->c_nfree_frames--;
+                        fte->next_free_frame = NULL;
+                        buddy_free(fte - frame_table, 0);
+                }
+                spinlock_release(&mem_lock);
+                drained = true;
+        }
+
+        spinlock_release(&c->c_frame_lock);
+        splx(spl);
+
+        if (drained) {
+                zero_pool_kick();
+        }
+}
+
+/*
+ * Empties every cpu's frame cache into the buddy lists, for when an
+ * allocation has found nothing anywhere else. Returns true if any
+ * frames came back.
+ */
+static bool frame_cache_reclaim(void)
+{
+        unsigned int i;
+        bool found;
+        struct cpu *c;
+        struct frame_table_entry *fte;
+
+        found = false;
+        for (i = 0; i < cpu_count(); i++) {
+                c = cpu_get(i);
+                spinlock_acquire(&c->c_frame_lock);
+                if (c->c_nfree_frames > 0) {
+                        spinlock_acquire(&mem_lock);
+                        while ((fte = c->c_free_frames) != NULL) {
+                                c->c_free_frames = fte->next_free_frame;
+                                fte->next_free_frame = NULL;
+                                buddy_free(fte - frame_table, 0);
+                        }
+                        c->c_nfree_frames = 0;
+                        spinlock_release(&mem_lock);
+                        found = true;
+                }
+                spinlock_release(&c->c_frame_lock);
+        }
+
+        return found;
+}
+
 void frame_table_init(unsigned int nframes) 
 {
         unsigned int i;
+        unsigned int order;
         unsigned int firstfree;
 
-        /* reserve space for the frame and page tables */
+        /* 
+         * reserve space for the frame and page tables - frames below
+         * firstfree are already in use, so they hold a reference
+         */
+        firstfree = ram_getfirstfree() / PAGE_SIZE;
         for (i = 0; i < nframes; i++) {
                 frame_table[i].next_free_frame = NULL;
+                frame_table[i].prev_free_frame = NULL;
+                frame_table[i].refcount = (i < firstfree) ? 1 : 0;
+                frame_table[i].owners = NULL;
+                frame_table[i].mapcount = 0;
+                frame_table[i].state = (i < firstfree) ? FRAME_KERNEL 
+                                                       : FRAME_FREE;
+                frame_table[i].order = (i < firstfree) ? 0 : FRAME_NO_ORDER;
+                frame_table[i].referenced = false;
+                frame_table[i].dirty = false;
         }
 
-        /* make free frame list */
-        firstfree = ram_getfirstfree() / PAGE_SIZE;
-        for (i = firstfree; i < nframes - 1; i++) {
-                frame_table[i].next_free_frame = &frame_table[i + 1];
+        for (i = 0; i <= FRAME_MAX_ORDER; i++) {
+                free_lists[i] = NULL;
         }
 
-        free_frame_ptr = &frame_table[firstfree];
+        first_frame = firstfree;
+        total_frames = nframes;
+        clock_hand = firstfree;
+        free_list_frames = nframes - firstfree;
+
+        /* carve the free frames into the largest aligned blocks that fit */
+        i = firstfree;
+        while (i < nframes) {
+                order = 0;
+                while (order < FRAME_MAX_ORDER &&
+                       (i & ((2U << order) - 1)) == 0 &&
+                       i + (2U << order) <= nframes) {
+                        order++;
+                }
+                free_list_push(&frame_table[i], order);
+                i += 1U << order;
+        }
 }
 
-/* Note that this function returns a VIRTUAL address, not a physical 
- * address
- * WARNING: this function gets called very early, before
- * vm_bootstrap().  You may wish to modify main.c to call your
- * frame table initialisation function, or check to see if the
- * frame table has been initialised and call ram_stealmem() otherwise.
+/*
+ * Allocates a block of npages frames. Single frames come from the pool
+ * of pre-zeroed frames if zeroing was asked for, and from the cpu's
+ * cache otherwise (or if the pool is empty).
  */
-
-vaddr_t alloc_kpages(unsigned int npages)
+static vaddr_t frame_alloc(unsigned int npages, bool zero)
 {
         paddr_t addr;
+        unsigned int order;
+        unsigned int index;
+
+        if (npages == 0) {
+                return 0;
+        }
 
         if (frame_table == NULL) {
                 spinlock_acquire(&mem_lock);
@@ -56,31 +524,90 @@ vaddr_t alloc_kpages(unsigned int npages)
                 }
         }
         else {
-                /* only allocate 1 page */
-                if (npages != 1) {
+                /* round up to a power of two number of frames */
+                order = 0;
+                while ((1U << order) < npages) {
+                        order++;
+                }
+                if (order > FRAME_MAX_ORDER) {
                         return 0;
                 }
 
-                /* no memory */
-                if (free_frame_ptr == NULL) {
-                        return 0;
+                if (order == 0) {
+                        index = zero ? zero_pool_get() : 0;
+                        if (index != 0) {
+                                VMSTAT_INC(frame_allocs);
+                                VMSTAT_INC(zero_pool_hits);
+                                pageout_kick();
+                                return PADDR_TO_KVADDR(index * PAGE_SIZE);
+                        }
+
+                        index = frame_cache_alloc();
+                        if (index == 0 && !zero) {
+                                index = zero_pool_get();
+                        }
+                }
+                else {
+                        do {
+                                spinlock_acquire(&mem_lock);
+                                index = buddy_alloc(order);
+                                spinlock_release(&mem_lock);
+                        } while (index == 0 && (zero_pool_flush() ||
+                                                frame_cache_reclaim()));
                 }
 
-                spinlock_acquire(&mem_lock);
+                /* let the pageout thread know if memory is running low */
+                pageout_kick();
 
-                addr = (free_frame_ptr - frame_table) * PAGE_SIZE; 
-                free_frame_ptr = free_frame_ptr->next_free_frame;
+                /* no memory */
+                if (index == 0) {
+                        return 0;
+                }
 
-                spinlock_release(&mem_lock);
+                addr = index * PAGE_SIZE;
+                VMSTAT_ADD(frame_allocs, 1U << order);
+                if (zero) {
+                        VMSTAT_ADD(zero_fills, 1U << order);
+                }
         }
 
-        bzero((void *) PADDR_TO_KVADDR(addr), PAGE_SIZE);
+        if (zero) {
+                bzero((void *) PADDR_TO_KVADDR(addr), npages * PAGE_SIZE);
+        }
 
         return PADDR_TO_KVADDR(addr);
 }
 
+/* Note that this function returns a VIRTUAL address, not a physical 
+ * address
+ * WARNING: this function gets called very early, before
+ * vm_bootstrap().  You may wish to modify main.c to call your
+ * frame table initialisation function, or check to see if the
+ * frame table has been initialised and call ram_stealmem() otherwise.
+ */
+
+vaddr_t alloc_kpages(unsigned int npages)
+{
+        return frame_alloc(npages, true);
+}
+
+/* 
+ * As alloc_kpages, but leaves the old contents in place for callers that
+ * are about to overwrite the whole block anyway
+ */
+vaddr_t alloc_kpages_nozero(unsigned int npages)
+{
+        return frame_alloc(npages, false);
+}
+
+/* 
+ * Drops a reference to the block at the given kernel virtual address,
+ * the block only goes back on the free lists once every mapping of it
+ * (e.g. copy-on-write sharers) has let go 
+ */
 void free_kpages(vaddr_t addr)
 {
+        bool last;
         paddr_t paddr;
         struct frame_table_entry *to_free;
 
@@ -91,12 +618,270 @@ void free_kpages(vaddr_t addr)
 
         paddr = KVADDR_TO_PADDR(addr);
 
+        to_free = &frame_table[paddr / PAGE_SIZE];
+        KASSERT(to_free->refcount > 0);
+        KASSERT(to_free->order != FRAME_NO_ORDER);
+
+        /* 
+         * Only a shared frame needs the lock to drop a reference: the
+         * holder of the last one is the only party that could take
+         * another, so nobody can be racing us.
+         */
+        if (to_free->refcount > 1) {
+                spinlock_acquire(&mem_lock);
+                to_free->refcount--;
+                last = (to_free->refcount == 0);
+                spinlock_release(&mem_lock);
+
+                if (!last) {
+                        return;
+                }
+        }
+
+        VMSTAT_ADD(frame_frees, 1U << to_free->order);
+        if (to_free->order == 0) {
+                frame_cache_free(to_free);
+        }
+        else {
+                spinlock_acquire(&mem_lock);
+                buddy_free(paddr / PAGE_SIZE, to_free->order);
+                spinlock_release(&mem_lock);
+        }
+}
+
+/* 
+ * Returns roughly how many frames are free, those sitting in the cpus'
+ * caches included. Read without the locks, so only a snapshot.
+ */
+unsigned int frame_free_count(void)
+{
+        unsigned int i, count;
+
+        count = free_list_frames + zero_pool_count;
+        for (i = 0; i < cpu_count(); i++) {
+                count += cpu_get(i)->c_nfree_frames;
+        }
+
+        return count;
+}
+
+/* Returns how many frames there were to allocate from after boot */
+unsigned int frame_total_count(void)
+{
+        return total_frames - first_frame;
+}
+
+/* Returns how many free frames are already zeroed, as a snapshot */
+unsigned int frame_zero_count(void)
+{
+        return zero_pool_count;
+}
+
+/* Takes another reference to an allocated frame for sharing */
+void frame_ref(paddr_t paddr)
+{
+        struct frame_table_entry *fte;
+
+        KASSERT(frame_table != NULL);
+
         spinlock_acquire(&mem_lock);
 
-        to_free = &frame_table[paddr / PAGE_SIZE];
-        to_free->next_free_frame = free_frame_ptr;
-        free_frame_ptr = to_free;
+        fte = &frame_table[paddr / PAGE_SIZE];
+        KASSERT(fte->refcount > 0);
+        fte->refcount++;
 
         spinlock_release(&mem_lock);
 }
 
+/* Number of references currently held on an allocated frame */
+unsigned int frame_refcount(paddr_t paddr)
+{
+        unsigned int refcount;
+
+        KASSERT(frame_table != NULL);
+
+        spinlock_acquire(&mem_lock);
+        refcount = frame_table[paddr / PAGE_SIZE].refcount;
+        spinlock_release(&mem_lock);
+
+        return refcount;
+}
+
+
+/* Puts pte on the frame's owner list unless it is there already */
+static void frame_owner_add(struct frame_table_entry *fte,
+                            struct page_table_entry *pte)
+{
+        struct page_table_entry *curr;
+
+        for (curr = fte->owners; curr != NULL; curr = curr->rmap_next) {
+                if (curr == pte) {
+                        return;
+                }
+        }
+
+        pte->rmap_next = fte->owners;
+        fte->owners = pte;
+        fte->mapcount++;
+}
+
+/* 
+ * Hands a frame over to the user page mapped by pte, making it a
+ * candidate for page replacement while it is not shared.
+ */
+void frame_set_user(paddr_t paddr, struct page_table_entry *pte)
+{
+        struct frame_table_entry *fte;
+
+        spinlock_acquire(&mem_lock);
+
+        fte = &frame_table[paddr / PAGE_SIZE];
+        KASSERT(fte->refcount > 0);
+        fte->state = FRAME_USER;
+        frame_owner_add(fte, pte);
+        fte->referenced = true;
+
+        spinlock_release(&mem_lock);
+}
+
+/* 
+ * Records another mapping of a frame (a copy-on-write sharer, or a
+ * page cache frame mapped in place) without changing its state.
+ */
+void frame_add_owner(paddr_t paddr, struct page_table_entry *pte)
+{
+        struct frame_table_entry *fte;
+
+        spinlock_acquire(&mem_lock);
+
+        fte = &frame_table[paddr / PAGE_SIZE];
+        KASSERT(fte->refcount > 0);
+        frame_owner_add(fte, pte);
+
+        spinlock_release(&mem_lock);
+}
+
+/* 
+ * Gives the frame a second chance. Called on every tlb refill, so it
+ * skips the lock; losing a race with the clock only costs accuracy.
+ */
+void frame_set_referenced(paddr_t paddr)
+{
+        frame_table[paddr / PAGE_SIZE].referenced = true;
+}
+
+/* 
+ * Notes that a writable mapping of the frame went into a tlb. Only ever
+ * set without the lock, and dirty has a byte of its own, so the clock 
+ * clearing referenced can't lose it.
+ */
+void frame_set_dirty(paddr_t paddr)
+{
+        frame_table[paddr / PAGE_SIZE].dirty = true;
+}
+
+/*
+ * Second-chance clock over the frame table. Picks a user frame with a
+ * single mapping and no other references that has not been referenced
+ * since the hand last passed it, clearing reference bits on the way, 
+ * and hands back that mapping from the owner list. Returns false if two
+ * sweeps turned up nothing.
+ */
+bool frame_clock_select(paddr_t *paddr, struct page_table_entry **pte)
+{
+        unsigned int i;
+        struct frame_table_entry *fte;
+
+        spinlock_acquire(&mem_lock);
+
+        for (i = 0; i < 2 * (total_frames - first_frame); i++) {
+                fte = &frame_table[clock_hand];
+
+                clock_hand++;
+                if (clock_hand == total_frames) {
+                        clock_hand = first_frame;
+                }
+
+                if (fte->state != FRAME_USER || fte->refcount != 1 ||
+                    fte->mapcount != 1) {
+                        continue;
+                }
+
+                if (fte->referenced) {
+                        fte->referenced = false;
+                        continue;
+                }
+
+                *paddr = (fte - frame_table) * PAGE_SIZE;
+                *pte = fte->owners;
+                spinlock_release(&mem_lock);
+                return true;
+        }
+
+        spinlock_release(&mem_lock);
+        return false;
+}
+
+/* 
+ * Claims a frame picked by frame_clock_select if pte still maps it
+ * alone, handing back whether it has been mapped writable.
+ */
+bool frame_claim(paddr_t paddr, struct page_table_entry *pte, bool *dirty)
+{
+        bool claimed = false;
+        struct frame_table_entry *fte;
+
+        spinlock_acquire(&mem_lock);
+
+        fte = &frame_table[paddr / PAGE_SIZE];
+        if (fte->state == FRAME_USER && fte->owners == pte && 
+            fte->mapcount == 1 && fte->refcount == 1) {
+                fte->state = FRAME_EVICTING;
+                *dirty = fte->dirty;
+                claimed = true;
+        }
+
+        spinlock_release(&mem_lock);
+
+        return claimed;
+}
+
+/*
+ * Takes pte off the owner list of a frame it no longer maps (it was
+ * unmapped, or broke copy-on-write sharing). Once a sibling has let go
+ * this way, the one mapping left makes the frame a candidate for the
+ * clock again.
+ */
+void frame_disown(paddr_t paddr, struct page_table_entry *pte)
+{
+        struct frame_table_entry *fte;
+        struct page_table_entry **prev;
+
+        spinlock_acquire(&mem_lock);
+
+        fte = &frame_table[paddr / PAGE_SIZE];
+        for (prev = &fte->owners; *prev != NULL; 
+             prev = &(*prev)->rmap_next) {
+                if (*prev == pte) {
+                        *prev = pte->rmap_next;
+                        fte->mapcount--;
+                        break;
+                }
+        }
+
+        spinlock_release(&mem_lock);
+}
+
+/* Returns a claimed frame to use if it could not be paged out */
+void frame_unclaim(paddr_t paddr)
+{
+        struct frame_table_entry *fte;
+
+        spinlock_acquire(&mem_lock);
+
+        fte = &frame_table[paddr / PAGE_SIZE];
+        KASSERT(fte->state == FRAME_EVICTING);
+        fte->state = FRAME_USER;
+
+        spinlock_release(&mem_lock);
+}
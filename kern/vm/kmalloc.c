@@ -1205,6 +1205,22 @@ kmalloc(size_t sz)
 #endif
 }
 
+/*
+ * Return how much memory kmalloc(SZ) actually takes up: the size of
+ * the block it rounds SZ up to, or the whole pages for a large one.
+ */
+size_t
+kmalloc_size(size_t sz)
+{
+	size_t checksz;
+
+	checksz = sz + GUARD_OVERHEAD + LABEL_OVERHEAD;
+	if (checksz >= LARGEST_SUBPAGE_SIZE) {
+		return ROUNDUP(sz, PAGE_SIZE);
+	}
+	return sizes[blocktype(checksz)];
+}
+
 /*
  * Free a block previously returned from kmalloc.
  */
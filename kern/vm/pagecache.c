@@ -0,0 +1,343 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vm.h>
+
+/*
+ * Cache of pages read in from files, so that processes running the same
+ * binary, or mapping the same file, share one frame per page. A page is
+ * known by the file and the bytes of it the page holds: LEN bytes from
+ * file offset FOFF placed HEAD bytes into the page, the rest being zero.
+ *
+ * Every entry holds a reference on its frame, and is also on its
+ * vnode's list of cached pages. It holds no reference on the vnode:
+ * the regions mapping the file do, and once the last reference goes
+ * vnode_cleanup drops the file's pages (see page_cache_forget), so an
+ * unlinked file's blocks are freed and its volume can be unmounted.
+ * Otherwise the cache is only trimmed when memory runs short (see
+ * vm_alloc_page), or wholesale before an unmount.
+ *
+ * Writes to a file through write() or ftruncate() update its cached
+ * pages (see page_cache_update), so later faults see the new contents.
+ * A page nobody maps is just dropped; a mapped one is brought up to
+ * date in place, so its mappers see the write and share the frame with
+ * whoever maps the file next.
+ */
+
+#define PAGE_CACHE_SIZE 256     /* hash buckets */
+
+struct cached_page {
+        struct vnode *vnode;
+        off_t foff;
+        unsigned int head;
+        unsigned int len;
+        paddr_t paddr;
+        bool stale;                     /* mapped, waiting for an update */
+        struct cached_page *next;       /* hash chain */
+        struct cached_page *vnext;      /* next page of the same vnode */
+        struct cached_page **vprev;     /* link that points at this one */
+};
+
+static struct cached_page *page_cache[PAGE_CACHE_SIZE];
+static struct spinlock page_cache_lock = SPINLOCK_INITIALIZER;
+
+static unsigned int
+page_cache_hash(struct vnode *v, off_t foff)
+{
+        return (((uint32_t) v >> 4) ^ (uint32_t) (foff >> PAGE_BITS)) %
+               PAGE_CACHE_SIZE;
+}
+
+/* Called with page_cache_lock held */
+static struct cached_page *
+page_cache_find(struct vnode *v, off_t foff, unsigned int head,
+                unsigned int len)
+{
+        struct cached_page *curr;
+
+        for (curr = page_cache[page_cache_hash(v, foff)]; curr != NULL;
+             curr = curr->next) {
+                if (curr->vnode == v && curr->foff == foff &&
+                    curr->head == head && curr->len == len) {
+                        return curr;
+                }
+        }
+
+        return NULL;
+}
+
+/*
+ * Looks a page up, returning its frame with a reference taken for the
+ * caller, or 0 if it is not cached.
+ */
+paddr_t
+page_cache_lookup(struct vnode *v, off_t foff, unsigned int head,
+                  unsigned int len)
+{
+        paddr_t paddr = 0;
+        struct cached_page *page;
+
+        spinlock_acquire(&page_cache_lock);
+        page = page_cache_find(v, foff, head, len);
+        if (page != NULL) {
+                paddr = page->paddr;
+                frame_ref(paddr);
+        }
+        spinlock_release(&page_cache_lock);
+
+        return paddr;
+}
+
+/*
+ * Adds a freshly read page, on which the caller holds a reference, to
+ * the cache. If someone else got there first, the caller's frame is
+ * released and the cached one handed back (referenced) instead. If the
+ * cache entry cannot be allocated, the page simply stays private.
+ */
+paddr_t
+page_cache_insert(struct vnode *v, off_t foff, unsigned int head,
+                  unsigned int len, paddr_t paddr)
+{
+        paddr_t cached;
+        struct cached_page *page, *new;
+        unsigned int hash = page_cache_hash(v, foff);
+
+        new = kmalloc(sizeof(struct cached_page));
+        if (new == NULL) {
+                return paddr;
+        }
+
+        spinlock_acquire(&page_cache_lock);
+
+        page = page_cache_find(v, foff, head, len);
+        if (page != NULL) {
+                cached = page->paddr;
+                frame_ref(cached);
+                spinlock_release(&page_cache_lock);
+
+                kfree(new);
+                free_kpages(PADDR_TO_KVADDR(paddr));
+                return cached;
+        }
+
+        frame_ref(paddr);
+        new->vnode = v;
+        new->foff = foff;
+        new->head = head;
+        new->len = len;
+        new->paddr = paddr;
+        new->stale = false;
+        new->next = page_cache[hash];
+        page_cache[hash] = new;
+        new->vnext = v->vn_pages;
+        new->vprev = &v->vn_pages;
+        if (v->vn_pages != NULL) {
+                v->vn_pages->vprev = &new->vnext;
+        }
+        v->vn_pages = new;
+
+        spinlock_release(&page_cache_lock);
+
+        return paddr;
+}
+
+/* Called with page_cache_lock held, moves an entry to the dropped list */
+static void
+page_cache_unlink(struct cached_page **prev, struct cached_page **dropped)
+{
+        struct cached_page *curr = *prev;
+
+        *prev = curr->next;
+        *curr->vprev = curr->vnext;
+        if (curr->vnext != NULL) {
+                curr->vnext->vprev = curr->vprev;
+        }
+        curr->next = *dropped;
+        *dropped = curr;
+}
+
+/* Called with page_cache_lock held, returns the hash link to PAGE */
+static struct cached_page **
+page_cache_link(struct cached_page *page)
+{
+        struct cached_page **prev;
+
+        prev = &page_cache[page_cache_hash(page->vnode, page->foff)];
+        while (*prev != page) {
+                KASSERT(*prev != NULL);
+                prev = &(*prev)->next;
+        }
+
+        return prev;
+}
+
+/* Releases entries taken out of the cache, without the lock */
+static void
+page_cache_release(struct cached_page *dropped)
+{
+        struct cached_page *curr;
+
+        while (dropped != NULL) {
+                curr = dropped;
+                dropped = curr->next;
+                free_kpages(PADDR_TO_KVADDR(curr->paddr));
+                kfree(curr);
+        }
+}
+
+/*
+ * Drops cached pages to free memory. Unless ALL is set, only pages no
+ * process maps any more are dropped; otherwise every entry goes, which
+ * leaves mapped pages to their mappers (and so to the page replacement
+ * clock). Returns true if any entry was dropped.
+ */
+bool
+page_cache_shrink(bool all)
+{
+        unsigned int i;
+        struct cached_page **prev, *curr, *dropped;
+
+        dropped = NULL;
+
+        spinlock_acquire(&page_cache_lock);
+        for (i = 0; i < PAGE_CACHE_SIZE; i++) {
+                prev = &page_cache[i];
+                while ((curr = *prev) != NULL) {
+                        if (!all && frame_refcount(curr->paddr) > 1) {
+                                prev = &curr->next;
+                                continue;
+                        }
+                        page_cache_unlink(prev, &dropped);
+                }
+        }
+        spinlock_release(&page_cache_lock);
+
+        if (dropped == NULL) {
+                return false;
+        }
+
+        page_cache_release(dropped);
+
+        return true;
+}
+
+/*
+ * Drops every cached page of V, which is going away: called from
+ * vnode_cleanup once the file system has forgotten V, so nobody can
+ * look its pages up again. Processes still mapping a frame keep their
+ * own references to it.
+ */
+void
+page_cache_forget(struct vnode *v)
+{
+        struct cached_page *dropped;
+
+        if (v->vn_pages == NULL) {
+                return;
+        }
+
+        dropped = NULL;
+
+        spinlock_acquire(&page_cache_lock);
+        while (v->vn_pages != NULL) {
+                page_cache_unlink(page_cache_link(v->vn_pages), &dropped);
+        }
+        spinlock_release(&page_cache_lock);
+
+        page_cache_release(dropped);
+}
+
+/*
+ * Re-reads the bytes of a cached page that fall in [start, end) from
+ * the file, zeroing any the file no longer has. The caller holds a
+ * reference on the frame.
+ */
+static void
+page_cache_refresh(struct vnode *v, off_t foff, unsigned int head,
+                   unsigned int len, paddr_t paddr, off_t start, off_t end)
+{
+        int result;
+        off_t lo, hi;
+        char *kaddr;
+        struct iovec iov;
+        struct uio ku;
+
+        lo = (start > foff) ? start : foff;
+        hi = (end < foff + len) ? end : foff + len;
+        kaddr = (char *) PADDR_TO_KVADDR(paddr) + head + (lo - foff);
+
+        uio_kinit(&iov, &ku, kaddr, hi - lo, lo, UIO_READ);
+        result = VOP_READ(v, &ku);
+        if (result) {
+                /* leave it zeroed rather than half old, half new */
+                ku.uio_resid = hi - lo;
+        }
+        bzero(kaddr + (hi - lo) - ku.uio_resid, ku.uio_resid);
+}
+
+/*
+ * Brings the cached pages of V up to date after the file's bytes in
+ * [start, end) have changed. Pages nobody maps are dropped. Mapped ones
+ * are marked stale and then read back one at a time without the lock,
+ * so they stay in the cache (and shared) throughout. Only V's own list
+ * is walked, so a file with nothing cached costs next to nothing.
+ */
+void
+page_cache_update(struct vnode *v, off_t start, off_t end)
+{
+        off_t foff;
+        paddr_t paddr;
+        unsigned int head, len;
+        struct cached_page *curr, *next, *dropped;
+
+        /* a page cached concurrently with the write may be missed anyway */
+        if (v->vn_pages == NULL) {
+                return;
+        }
+
+        dropped = NULL;
+
+        spinlock_acquire(&page_cache_lock);
+        for (curr = v->vn_pages; curr != NULL; curr = next) {
+                next = curr->vnext;
+                if (curr->foff >= end || curr->foff + curr->len <= start) {
+                        continue;
+                }
+                if (frame_refcount(curr->paddr) > 1) {
+                        curr->stale = true;
+                }
+                else {
+                        page_cache_unlink(page_cache_link(curr), &dropped);
+                }
+        }
+
+        while (true) {
+                for (curr = v->vn_pages; curr != NULL; curr = curr->vnext) {
+                        if (curr->stale) {
+                                break;
+                        }
+                }
+                if (curr == NULL) {
+                        break;
+                }
+
+                curr->stale = false;
+                foff = curr->foff;
+                head = curr->head;
+                len = curr->len;
+                paddr = curr->paddr;
+                frame_ref(paddr);
+                spinlock_release(&page_cache_lock);
+
+                page_cache_refresh(v, foff, head, len, paddr, start, end);
+                free_kpages(PADDR_TO_KVADDR(paddr));
+
+                spinlock_acquire(&page_cache_lock);
+        }
+        spinlock_release(&page_cache_lock);
+
+        page_cache_release(dropped);
+}
@@ -0,0 +1,200 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vm.h>
+
+/*
+ * Read-ahead. When vm_fault sees a region being faulted in page after
+ * page it queues the next few pages here, and the prefetch thread reads
+ * them in while the process gets on with the pages it already has. File
+ * pages go into the page cache, swapped pages into the swap cache (see
+ * swap.c), so nothing here ever touches an address space: whichever
+ * fault comes along next just finds the page already in memory.
+ *
+ * The queue is a small ring. Read-ahead is only a hint, so a request
+ * that finds the ring full, or a frame that cannot be had without
+ * paging something out, is simply dropped.
+ */
+
+#define PREFETCH_QUEUE 64
+
+struct prefetch {
+        struct vnode *vnode;    /* file to read from, or NULL for swap */
+        off_t foff;             /* as for the page cache */
+        unsigned int head;
+        unsigned int len;
+        unsigned int slot;      /* swap slot, if vnode is NULL */
+};
+
+static struct prefetch prefetch_queue[PREFETCH_QUEUE];
+static unsigned int prefetch_head = 0;
+static unsigned int prefetch_count = 0;
+static struct wchan *prefetch_wchan = NULL;
+static struct spinlock prefetch_lock = SPINLOCK_INITIALIZER;
+
+/* Queues a request, returning false if there is no room */
+static bool
+prefetch_queue_add(const struct prefetch *req)
+{
+        bool added = false;
+
+        spinlock_acquire(&prefetch_lock);
+        if (prefetch_wchan != NULL && prefetch_count < PREFETCH_QUEUE) {
+                prefetch_queue[(prefetch_head + prefetch_count) %
+                               PREFETCH_QUEUE] = *req;
+                prefetch_count++;
+                wchan_wakeone(prefetch_wchan, &prefetch_lock);
+                added = true;
+        }
+        spinlock_release(&prefetch_lock);
+
+        return added;
+}
+
+/*
+ * Asks for LEN bytes of V from FOFF, placed HEAD bytes into a page, to
+ * be read into the page cache.
+ */
+void
+prefetch_file(struct vnode *v, off_t foff, unsigned int head,
+              unsigned int len)
+{
+        struct prefetch req;
+
+        VOP_INCREF(v);
+        req.vnode = v;
+        req.foff = foff;
+        req.head = head;
+        req.len = len;
+        req.slot = 0;
+
+        if (!prefetch_queue_add(&req)) {
+                VOP_DECREF(v);
+        }
+}
+
+/* Asks for the page in swap slot SLOT to be read into the swap cache */
+void
+prefetch_swap(unsigned int slot)
+{
+        struct prefetch req;
+
+        req.vnode = NULL;
+        req.foff = 0;
+        req.head = 0;
+        req.len = 0;
+        req.slot = slot;
+
+        prefetch_queue_add(&req);
+}
+
+static void
+prefetch_read_file(struct prefetch *req)
+{
+        int result;
+        paddr_t paddr;
+        vaddr_t vaddr;
+        struct iovec iov;
+        struct uio ku;
+
+        paddr = page_cache_lookup(req->vnode, req->foff, req->head, req->len);
+        if (paddr != 0) {
+                free_kpages(PADDR_TO_KVADDR(paddr));
+                return;
+        }
+
+        vaddr = (req->len < PAGE_SIZE) ? alloc_kpages(1) :
+                                         alloc_kpages_nozero(1);
+        if (vaddr == 0) {
+                return;
+        }
+
+        uio_kinit(&iov, &ku, (void *) (vaddr + req->head), req->len,
+                  req->foff, UIO_READ);
+        result = VOP_READ(req->vnode, &ku);
+        if (result || ku.uio_resid != 0) {
+                free_kpages(vaddr);
+                return;
+        }
+
+        /* the cache keeps its own reference, drop ours */
+        paddr = page_cache_insert(req->vnode, req->foff, req->head,
+                                  req->len, KVADDR_TO_PADDR(vaddr));
+        free_kpages(PADDR_TO_KVADDR(paddr));
+}
+
+static void
+prefetch_read_swap(struct prefetch *req)
+{
+        vaddr_t vaddr;
+
+        if (!swap_cache_reserve(req->slot)) {
+                return;
+        }
+
+        vaddr = alloc_kpages_nozero(1);
+        if (vaddr == 0) {
+                swap_cache_fill(req->slot, 0);
+                return;
+        }
+
+        if (swap_read(req->slot, KVADDR_TO_PADDR(vaddr))) {
+                free_kpages(vaddr);
+                swap_cache_fill(req->slot, 0);
+                return;
+        }
+
+        swap_cache_fill(req->slot, KVADDR_TO_PADDR(vaddr));
+}
+
+/* The prefetch thread. Works through the queue, sleeping when it is empty */
+static void
+prefetch_thread(void *data1, unsigned long data2)
+{
+        struct prefetch req;
+
+        (void) data1;
+        (void) data2;
+
+        while (true) {
+                spinlock_acquire(&prefetch_lock);
+                while (prefetch_count == 0) {
+                        wchan_sleep(prefetch_wchan, &prefetch_lock);
+                }
+                req = prefetch_queue[prefetch_head];
+                prefetch_head = (prefetch_head + 1) % PREFETCH_QUEUE;
+                prefetch_count--;
+                spinlock_release(&prefetch_lock);
+
+                if (req.vnode != NULL) {
+                        prefetch_read_file(&req);
+                        VOP_DECREF(req.vnode);
+                }
+                else {
+                        prefetch_read_swap(&req);
+                }
+        }
+}
+
+/* Starts the prefetch thread, once threads can be forked */
+void
+prefetch_bootstrap(void)
+{
+        int result;
+
+        prefetch_wchan = wchan_create("prefetch");
+        if (prefetch_wchan == NULL) {
+                panic("prefetch_bootstrap: out of memory\n");
+        }
+
+        result = thread_fork("prefetch", NULL, prefetch_thread, NULL, 0);
+        if (result) {
+                panic("prefetch_bootstrap: thread_fork failed: %s\n",
+                      strerror(result));
+        }
+}
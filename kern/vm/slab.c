@@ -0,0 +1,132 @@
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <vm.h>
+#include <slab.h>
+
+/*
+ * Object caches (see slab.h). Objects are chained through the link
+ * field chosen for the cache, which slab_next gets at.
+ */
+
+static void **
+slab_next(struct slab_cache *sc, void *obj)
+{
+        return (void **) ((char *) obj + sc->sc_link);
+}
+
+/*
+ * Carves a fresh page into objects and puts them on the shared list.
+ * Returns false if there is no page to be had.
+ */
+static bool
+slab_grow(struct slab_cache *sc)
+{
+        unsigned int i, nobjs;
+        char *page, *obj;
+
+        page = (char *) alloc_kpages(1);
+        if (page == NULL) {
+                return false;
+        }
+
+        nobjs = PAGE_SIZE / sc->sc_size;
+        KASSERT(nobjs > 0);
+
+        spinlock_acquire(&sc->sc_lock);
+        for (i = 0; i < nobjs; i++) {
+                obj = page + i * sc->sc_size;
+                *slab_next(sc, obj) = sc->sc_free;
+                sc->sc_free = obj;
+        }
+        sc->sc_nfree += nobjs;
+        sc->sc_pages++;
+        spinlock_release(&sc->sc_lock);
+
+        return true;
+}
+
+/*
+ * Moves up to a batch of objects from the shared list to this cpu's.
+ * Called at splhigh.
+ */
+static void
+slab_refill(struct slab_cache *sc, struct slab_cpu *pc)
+{
+        unsigned int i;
+        void *obj;
+
+        spinlock_acquire(&sc->sc_lock);
+        for (i = 0; i < SLAB_CPU_BATCH && sc->sc_free != NULL; i++) {
+                obj = sc->sc_free;
+                sc->sc_free = *slab_next(sc, obj);
+                sc->sc_nfree--;
+                *slab_next(sc, obj) = pc->free;
+                pc->free = obj;
+                pc->nfree++;
+        }
+        spinlock_release(&sc->sc_lock);
+}
+
+void *
+slab_alloc(struct slab_cache *sc)
+{
+        int spl;
+        void *obj;
+        struct slab_cpu *pc;
+
+        while (true) {
+                spl = splhigh();
+                pc = &sc->sc_cpu[curcpu->c_number];
+                if (pc->free == NULL) {
+                        slab_refill(sc, pc);
+                }
+
+                obj = pc->free;
+                if (obj != NULL) {
+                        pc->free = *slab_next(sc, obj);
+                        pc->nfree--;
+                        splx(spl);
+                        return obj;
+                }
+                splx(spl);
+
+                /* the shared list is empty too, make some more */
+                if (!slab_grow(sc)) {
+                        return NULL;
+                }
+        }
+}
+
+void
+slab_free(struct slab_cache *sc, void *obj)
+{
+        int spl;
+        unsigned int i;
+        struct slab_cpu *pc;
+
+        spl = splhigh();
+        pc = &sc->sc_cpu[curcpu->c_number];
+
+        *slab_next(sc, obj) = pc->free;
+        pc->free = obj;
+        pc->nfree++;
+
+        if (pc->nfree > SLAB_CPU_MAX) {
+                spinlock_acquire(&sc->sc_lock);
+                for (i = 0; i < SLAB_CPU_BATCH; i++) {
+                        obj = pc->free;
+                        pc->free = *slab_next(sc, obj);
+                        pc->nfree--;
+                        *slab_next(sc, obj) = sc->sc_free;
+                        sc->sc_free = obj;
+                        sc->sc_nfree++;
+                }
+                spinlock_release(&sc->sc_lock);
+        }
+
+        splx(spl);
+}
@@ -0,0 +1,736 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <vm.h>
+#include <vmstat.h>
+
+/*
+ * Swap space, in two tiers: a page going out is kept compressed in
+ * memory if it can be (see below), and otherwise written to a
+ * whole-page block on a raw disk. Page table entries hold swap slots,
+ * which swap_alloc hands out before anyone knows which tier the page
+ * will land in; a slot only takes a disk block once swap_write has to
+ * use the disk. There are as many slots as disk blocks plus
+ * ZSWAP_SLOTS_PER_PAGE for each page the compressed pool may use, so
+ * the pool works with no disk at all, and a small disk does not make
+ * it small. Bitmaps record which slots and which blocks are in use.
+ */
+
+#define SWAP_DEVICE "lhd1raw:"
+
+static struct vnode *swap_vnode = NULL;         /* NULL if no disk */
+static struct bitmap *swap_map = NULL;          /* slots in use */
+static struct bitmap *swap_disk_map = NULL;     /* disk blocks in use */
+static unsigned int swap_slots = 0;
+static unsigned int swap_blocks = 0;
+
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Swap cache: pages the prefetch thread has read in ahead of the faults
+ * that will want them, by slot. An entry with paddr 0 is a read still
+ * in progress. Freeing a slot, or writing it, drops its entry, so an
+ * entry can only ever hold what is on disk in its slot now; a read that
+ * was overtaken by either finds its entry gone and throws the page away.
+ */
+#define SWAP_CACHE_SIZE 32
+
+struct swap_cached {
+        bool inuse;
+        unsigned int slot;
+        paddr_t paddr;
+};
+
+static struct swap_cached swap_cache[SWAP_CACHE_SIZE];
+static unsigned int swap_cache_hand = 0;
+
+/*
+ * Compressed swap. Before a page goes to disk swap_write tries to keep
+ * it in memory: a page that is one word repeated (most often zero) is
+ * kept as just that word, and any other page is compressed with a small
+ * LZ77 coder and kept if it shrinks to ZSWAP_MAX_LEN bytes or less and
+ * the kmalloc buffer it needs is smaller than a page. The pool is
+ * charged the size of the buffers, not of the data, and may take up to
+ * 1/ZSWAP_POOL of memory; once that is used up, or kmalloc fails, pages
+ * spill to the disk. A page read back in gives up its compressed copy
+ * (see swap_keepable), so the pool only holds pages that are out.
+ */
+#define ZSWAP_MAX_LEN   (PAGE_SIZE / 2) /* largest compressed page kept */
+#define ZSWAP_POOL      4               /* share of memory for the pool */
+#define ZSWAP_SLOTS_PER_PAGE 4          /* slots per page of the pool */
+#define ZSWAP_HASH_BITS 12
+
+#define ZSWAP_DISK      0               /* the page is in its disk block */
+#define ZSWAP_SAME      1               /* one word repeated */
+#define ZSWAP_LZ        2               /* compressed in memory */
+
+#define ZSWAP_NOBLOCK   0xffffffff      /* no disk block */
+
+struct zswap_slot {
+        uint8_t kind;
+        uint16_t len;                   /* bytes of data */
+        uint32_t fill;                  /* the word, for ZSWAP_SAME */
+        uint8_t *data;                  /* compressed page, for ZSWAP_LZ */
+        uint32_t block;                 /* disk block, or ZSWAP_NOBLOCK */
+};
+
+static struct zswap_slot *zswap = NULL; /* one per slot */
+static struct lock *zswap_lock = NULL;  /* protects all of the below */
+static size_t zswap_bytes = 0;
+static size_t zswap_limit = 0;
+static uint8_t zswap_buf[ZSWAP_MAX_LEN];
+static uint16_t zswap_hash[1 << ZSWAP_HASH_BITS];
+
+/* Sets up the slot table, for the pool and whatever disk there is */
+static void
+zswap_bootstrap(unsigned int nframes)
+{
+        unsigned int i;
+
+        zswap_limit = (nframes / ZSWAP_POOL) * PAGE_SIZE;
+        swap_slots = swap_blocks +
+                     (zswap_limit / PAGE_SIZE) * ZSWAP_SLOTS_PER_PAGE;
+        if (swap_slots == 0) {
+                return;
+        }
+
+        zswap = kmalloc(swap_slots * sizeof(struct zswap_slot));
+        zswap_lock = lock_create("zswap");
+        swap_map = bitmap_create(swap_slots);
+        if (zswap == NULL || zswap_lock == NULL || swap_map == NULL) {
+                panic("swap: no memory for the slot table\n");
+        }
+
+        for (i = 0; i < swap_slots; i++) {
+                zswap[i].kind = ZSWAP_DISK;
+                zswap[i].len = 0;
+                zswap[i].fill = 0;
+                zswap[i].data = NULL;
+                zswap[i].block = ZSWAP_NOBLOCK;
+        }
+}
+
+/*
+ * Compresses a page into dst, returning the length, or 0 if it does
+ * not fit in max bytes. The output is groups of up to eight items, each
+ * group led by a byte whose bits tell which items are matches: a match
+ * is two bytes, a 12 bit distance back (less one) and a 4 bit length
+ * (less 3); anything else is a literal byte. The hash table remembers
+ * the last position each 3 byte prefix was seen at; stale positions
+ * from earlier pages are harmless, as every match is checked.
+ */
+static size_t
+zswap_compress(const uint8_t *src, uint8_t *dst, size_t max)
+{
+        size_t in, out, flags, cand, len, dist;
+        unsigned int item, hash;
+
+        in = 0;
+        out = 0;
+        flags = 0;
+        item = 8;
+        while (in < PAGE_SIZE) {
+                if (item == 8) {
+                        if (out == max) {
+                                return 0;
+                        }
+                        flags = out++;
+                        dst[flags] = 0;
+                        item = 0;
+                }
+
+                len = 0;
+                if (in + 3 <= PAGE_SIZE) {
+                        hash = ((src[in] << 16) | (src[in + 1] << 8) |
+                                src[in + 2]) * 2654435761U;
+                        hash >>= 32 - ZSWAP_HASH_BITS;
+                        cand = zswap_hash[hash];
+                        zswap_hash[hash] = in + 1;
+
+                        /* positions are kept plus one, so 0 is empty */
+                        if (cand != 0 && cand - 1 < in) {
+                                cand--;
+                                while (len < 18 && in + len < PAGE_SIZE &&
+                                       src[cand + len] == src[in + len]) {
+                                        len++;
+                                }
+                        }
+                }
+
+                if (len >= 3) {
+                        if (out + 2 > max) {
+                                return 0;
+                        }
+                        dist = in - cand - 1;
+                        dst[out++] = dist >> 4;
+                        dst[out++] = ((dist & 0xf) << 4) | (len - 3);
+                        dst[flags] |= 1 << item;
+                        in += len;
+                }
+                else {
+                        if (out == max) {
+                                return 0;
+                        }
+                        dst[out++] = src[in++];
+                }
+                item++;
+        }
+
+        return out;
+}
+
+/* Undoes zswap_compress, returning false if the data is not a page */
+static bool
+zswap_decompress(const uint8_t *src, size_t srclen, uint8_t *dst)
+{
+        size_t in, out, len, dist;
+        unsigned int item, flags;
+
+        in = 0;
+        out = 0;
+        while (in < srclen) {
+                flags = src[in++];
+                for (item = 0; item < 8 && in < srclen; item++) {
+                        if (!(flags & (1 << item))) {
+                                if (out == PAGE_SIZE) {
+                                        return false;
+                                }
+                                dst[out++] = src[in++];
+                                continue;
+                        }
+
+                        if (in + 2 > srclen) {
+                                return false;
+                        }
+                        dist = ((src[in] << 4) | (src[in + 1] >> 4)) + 1;
+                        len = (src[in + 1] & 0xf) + 3;
+                        in += 2;
+                        if (dist > out || out + len > PAGE_SIZE) {
+                                return false;
+                        }
+
+                        /* byte by byte, as the match may overlap itself */
+                        for (; len > 0; len--, out++) {
+                                dst[out] = dst[out - dist];
+                        }
+                }
+        }
+
+        return out == PAGE_SIZE;
+}
+
+/* Called with zswap_lock held, forgets whatever is kept for a slot */
+static void
+zswap_drop(struct zswap_slot *zs)
+{
+        if (zs->kind == ZSWAP_LZ) {
+                kfree(zs->data);
+                zswap_bytes -= kmalloc_size(zs->len);
+        }
+        zs->kind = ZSWAP_DISK;
+        zs->data = NULL;
+}
+
+/* Keeps the page at paddr in memory for SLOT, if it is worth it */
+static bool
+zswap_store(unsigned int slot, paddr_t paddr)
+{
+        unsigned int i;
+        size_t len, size;
+        uint8_t *data;
+        const uint32_t *words;
+        struct zswap_slot *zs;
+
+        words = (const uint32_t *) PADDR_TO_KVADDR(paddr);
+        zs = &zswap[slot];
+
+        lock_acquire(zswap_lock);
+        zswap_drop(zs);
+
+        for (i = 1; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+                if (words[i] != words[0]) {
+                        break;
+                }
+        }
+        if (i == PAGE_SIZE / sizeof(uint32_t)) {
+                zs->kind = ZSWAP_SAME;
+                zs->fill = words[0];
+                lock_release(zswap_lock);
+                return true;
+        }
+
+        len = zswap_compress((const uint8_t *) words, zswap_buf,
+                             ZSWAP_MAX_LEN);
+        /* a buffer the size of a page would save nothing */
+        size = (len == 0) ? PAGE_SIZE : kmalloc_size(len);
+        if (size >= PAGE_SIZE || zswap_bytes + size > zswap_limit) {
+                lock_release(zswap_lock);
+                return false;
+        }
+        data = kmalloc(len);
+        if (data == NULL) {
+                lock_release(zswap_lock);
+                return false;
+        }
+        memcpy(data, zswap_buf, len);
+
+        zs->kind = ZSWAP_LZ;
+        zs->len = len;
+        zs->data = data;
+        zswap_bytes += size;
+
+        lock_release(zswap_lock);
+        return true;
+}
+
+/*
+ * Fills the frame at paddr from memory, if SLOT's page is kept there.
+ * Otherwise returns false with the slot's disk block in *BLOCK.
+ */
+static bool
+zswap_load(unsigned int slot, paddr_t paddr, uint32_t *block)
+{
+        unsigned int i;
+        bool found;
+        uint32_t *words;
+        struct zswap_slot *zs;
+
+        words = (uint32_t *) PADDR_TO_KVADDR(paddr);
+        zs = &zswap[slot];
+
+        lock_acquire(zswap_lock);
+        found = true;
+        switch (zs->kind) {
+                case ZSWAP_SAME:
+                        for (i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+                                words[i] = zs->fill;
+                        }
+                        break;
+                case ZSWAP_LZ:
+                        if (!zswap_decompress(zs->data, zs->len,
+                                              (uint8_t *) words)) {
+                                panic("swap: slot %u is corrupt\n", slot);
+                        }
+                        break;
+                default:
+                        found = false;
+                        *block = zs->block;
+                        break;
+        }
+        lock_release(zswap_lock);
+
+        return found;
+}
+
+/*
+ * Returns true if a page read back from SLOT may keep the slot as its
+ * clean copy. One compressed in memory may not: it would hold on to
+ * pool space that pages going out need, so it gives the slot up and is
+ * compressed again if it goes out again.
+ */
+bool
+swap_keepable(unsigned int slot)
+{
+        bool keepable;
+
+        KASSERT(slot < swap_slots);
+
+        lock_acquire(zswap_lock);
+        keepable = (zswap[slot].kind != ZSWAP_LZ);
+        lock_release(zswap_lock);
+
+        return keepable;
+}
+
+/*
+ * Returns SLOT's disk block in *BLOCK, giving it one if it has none.
+ * Fails if there is no disk, or no free block on it.
+ */
+static int
+zswap_block(unsigned int slot, uint32_t *block)
+{
+        int result;
+        unsigned int index;
+        struct zswap_slot *zs = &zswap[slot];
+
+        result = 0;
+        lock_acquire(zswap_lock);
+        if (zs->block == ZSWAP_NOBLOCK) {
+                result = ENOMEM;
+                if (swap_disk_map != NULL) {
+                        spinlock_acquire(&swap_lock);
+                        result = bitmap_alloc(swap_disk_map, &index);
+                        spinlock_release(&swap_lock);
+                }
+                if (result == 0) {
+                        zs->block = index;
+                }
+        }
+        *block = zs->block;
+        lock_release(zswap_lock);
+
+        /* bitmap_alloc's ENOSPC means we are out of memory altogether */
+        return result ? ENOMEM : 0;
+}
+
+/* Forgets SLOT's page, wherever it is kept */
+static void
+zswap_free(unsigned int slot)
+{
+        uint32_t block;
+        struct zswap_slot *zs = &zswap[slot];
+
+        lock_acquire(zswap_lock);
+        zswap_drop(zs);
+        block = zs->block;
+        zs->block = ZSWAP_NOBLOCK;
+        lock_release(zswap_lock);
+
+        if (block != ZSWAP_NOBLOCK) {
+                spinlock_acquire(&swap_lock);
+                KASSERT(bitmap_isset(swap_disk_map, block));
+                bitmap_unmark(swap_disk_map, block);
+                spinlock_release(&swap_lock);
+        }
+}
+
+/* Opens the swap disk, if there is one, and sizes its block map */
+static void
+swap_disk_bootstrap(void)
+{
+        int result;
+        struct stat st;
+        char path[sizeof(SWAP_DEVICE)];
+
+        /* vfs_open destroys the path it is given */
+        strcpy(path, SWAP_DEVICE);
+
+        result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+        if (result) {
+                kprintf("swap: cannot open %s: %s, compressed swap only\n",
+                        SWAP_DEVICE, strerror(result));
+                swap_vnode = NULL;
+                return;
+        }
+
+        result = VOP_STAT(swap_vnode, &st);
+        if (result) {
+                kprintf("swap: cannot stat %s: %s, compressed swap only\n",
+                        SWAP_DEVICE, strerror(result));
+                vfs_close(swap_vnode);
+                swap_vnode = NULL;
+                return;
+        }
+
+        swap_blocks = st.st_size / PAGE_SIZE;
+        swap_disk_map = (swap_blocks == 0) ? NULL :
+                        bitmap_create(swap_blocks);
+        if (swap_disk_map == NULL) {
+                kprintf("swap: no space on %s, compressed swap only\n",
+                        SWAP_DEVICE);
+                vfs_close(swap_vnode);
+                swap_vnode = NULL;
+                swap_blocks = 0;
+                return;
+        }
+}
+
+void
+swap_bootstrap(unsigned int nframes)
+{
+        swap_disk_bootstrap();
+        zswap_bootstrap(nframes);
+        if (swap_slots == 0) {
+                kprintf("swap: no swap space, paging disabled\n");
+                return;
+        }
+
+        kprintf("swap: %u slots, %u pages on %s, %uk compressed in memory\n",
+                swap_slots, swap_blocks, SWAP_DEVICE,
+                (unsigned) (zswap_limit / 1024));
+}
+
+/* Returns the number of swap slots, 0 if paging is disabled */
+unsigned int
+swap_size(void)
+{
+        return swap_slots;
+}
+
+/* Reserves a free swap slot */
+int
+swap_alloc(unsigned int *slot)
+{
+        int result;
+
+        if (swap_map == NULL) {
+                return ENOMEM;
+        }
+
+        spinlock_acquire(&swap_lock);
+        result = bitmap_alloc(swap_map, slot);
+        spinlock_release(&swap_lock);
+
+        /* bitmap_alloc's ENOSPC means we are out of memory altogether */
+        return result ? ENOMEM : 0;
+}
+
+/* Called with swap_lock held, returns the slot's cache entry if any */
+static struct swap_cached *
+swap_cache_find(unsigned int slot)
+{
+        unsigned int i;
+
+        for (i = 0; i < SWAP_CACHE_SIZE; i++) {
+                if (swap_cache[i].inuse && swap_cache[i].slot == slot) {
+                        return &swap_cache[i];
+                }
+        }
+
+        return NULL;
+}
+
+/* Called with swap_lock held, empties an entry, handing back its frame */
+static paddr_t
+swap_cache_remove(struct swap_cached *sc)
+{
+        paddr_t paddr = 0;
+
+        if (sc != NULL) {
+                paddr = sc->paddr;
+                sc->inuse = false;
+                sc->paddr = 0;
+        }
+
+        return paddr;
+}
+
+/* Forgets whatever the cache holds for SLOT */
+static void
+swap_cache_drop(unsigned int slot)
+{
+        paddr_t paddr;
+
+        spinlock_acquire(&swap_lock);
+        paddr = swap_cache_remove(swap_cache_find(slot));
+        spinlock_release(&swap_lock);
+
+        if (paddr != 0) {
+                free_kpages(PADDR_TO_KVADDR(paddr));
+        }
+}
+
+/*
+ * Makes an entry for a read of SLOT about to start. Returns false if
+ * there is one already, or no room: when the cache is full a page
+ * read earlier that nobody has claimed makes way.
+ */
+bool
+swap_cache_reserve(unsigned int slot)
+{
+        unsigned int i;
+        paddr_t old = 0;
+        struct swap_cached *sc = NULL;
+
+        spinlock_acquire(&swap_lock);
+
+        /* nothing to gain from reading ahead what is kept in memory */
+        if (swap_cache_find(slot) != NULL ||
+            zswap[slot].kind != ZSWAP_DISK ||
+            zswap[slot].block == ZSWAP_NOBLOCK) {
+                spinlock_release(&swap_lock);
+                return false;
+        }
+
+        for (i = 0; i < SWAP_CACHE_SIZE && sc == NULL; i++) {
+                if (!swap_cache[i].inuse) {
+                        sc = &swap_cache[i];
+                }
+        }
+        for (i = 0; i < SWAP_CACHE_SIZE && sc == NULL; i++) {
+                swap_cache_hand = (swap_cache_hand + 1) % SWAP_CACHE_SIZE;
+                if (swap_cache[swap_cache_hand].paddr != 0) {
+                        sc = &swap_cache[swap_cache_hand];
+                        old = swap_cache_remove(sc);
+                }
+        }
+        if (sc != NULL) {
+                sc->inuse = true;
+                sc->slot = slot;
+                sc->paddr = 0;
+        }
+
+        spinlock_release(&swap_lock);
+
+        if (old != 0) {
+                free_kpages(PADDR_TO_KVADDR(old));
+        }
+
+        return sc != NULL;
+}
+
+/*
+ * Completes a read started with swap_cache_reserve, PADDR holding the
+ * page (or 0 if the read failed). The frame is freed if the entry was
+ * dropped in the meantime.
+ */
+void
+swap_cache_fill(unsigned int slot, paddr_t paddr)
+{
+        struct swap_cached *sc;
+
+        spinlock_acquire(&swap_lock);
+        sc = swap_cache_find(slot);
+        if (sc != NULL && sc->paddr == 0) {
+                if (paddr != 0) {
+                        sc->paddr = paddr;
+                        paddr = 0;
+                }
+                else {
+                        swap_cache_remove(sc);
+                }
+        }
+        spinlock_release(&swap_lock);
+
+        if (paddr != 0) {
+                free_kpages(PADDR_TO_KVADDR(paddr));
+        }
+}
+
+/*
+ * Takes the page read ahead for SLOT out of the cache, returning its
+ * frame or 0 if there is none. A read still in progress is abandoned.
+ */
+paddr_t
+swap_cache_take(unsigned int slot)
+{
+        paddr_t paddr;
+
+        spinlock_acquire(&swap_lock);
+        paddr = swap_cache_remove(swap_cache_find(slot));
+        spinlock_release(&swap_lock);
+
+        return paddr;
+}
+
+/* Gives back every page read ahead, returning true if there were any */
+bool
+swap_cache_shrink(void)
+{
+        unsigned int i;
+        paddr_t paddr;
+        bool dropped = false;
+
+        for (i = 0; i < SWAP_CACHE_SIZE; i++) {
+                spinlock_acquire(&swap_lock);
+                paddr = 0;
+                if (swap_cache[i].inuse && swap_cache[i].paddr != 0) {
+                        paddr = swap_cache_remove(&swap_cache[i]);
+                }
+                spinlock_release(&swap_lock);
+
+                if (paddr != 0) {
+                        free_kpages(PADDR_TO_KVADDR(paddr));
+                        dropped = true;
+                }
+        }
+
+        return dropped;
+}
+
+void
+swap_free(unsigned int slot)
+{
+        KASSERT(slot < swap_slots);
+
+        swap_cache_drop(slot);
+        zswap_free(slot);
+
+        spinlock_acquire(&swap_lock);
+        KASSERT(bitmap_isset(swap_map, slot));
+        bitmap_unmark(swap_map, slot);
+        spinlock_release(&swap_lock);
+}
+
+static int
+swap_io(uint32_t block, paddr_t paddr, enum uio_rw rw)
+{
+        int result;
+        struct iovec iov;
+        struct uio ku;
+
+        KASSERT(block < swap_blocks);
+
+        uio_kinit(&iov, &ku, (void *) PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+                  (off_t) block * PAGE_SIZE, rw);
+
+        if (rw == UIO_READ) {
+                result = VOP_READ(swap_vnode, &ku);
+        }
+        else {
+                result = VOP_WRITE(swap_vnode, &ku);
+        }
+        if (result) {
+                return result;
+        }
+
+        return (ku.uio_resid != 0) ? EIO : 0;
+}
+
+/* Reads the page in the given slot into the frame at paddr */
+int
+swap_read(unsigned int slot, paddr_t paddr)
+{
+        uint32_t block;
+
+        KASSERT(slot < swap_slots);
+
+        if (zswap_load(slot, paddr, &block)) {
+                VMSTAT_INC(zswap_loads);
+                return 0;
+        }
+        if (block == ZSWAP_NOBLOCK) {
+                /* never written */
+                return EIO;
+        }
+
+        VMSTAT_INC(disk_reads);
+        return swap_io(block, paddr, UIO_READ);
+}
+
+/*
+ * Keeps the frame at paddr in memory compressed for the given slot, or
+ * failing that writes it to the slot's disk block. Anything read ahead
+ * from the slot, even while the write was going on, is now stale.
+ */
+int
+swap_write(unsigned int slot, paddr_t paddr)
+{
+        int result;
+        uint32_t block;
+
+        KASSERT(slot < swap_slots);
+
+        if (zswap_store(slot, paddr)) {
+                VMSTAT_INC(zswap_stores);
+                result = 0;
+        }
+        else {
+                result = zswap_block(slot, &block);
+                if (result == 0) {
+                        VMSTAT_INC(disk_writes);
+                        result = swap_io(block, paddr, UIO_WRITE);
+                }
+        }
+        swap_cache_drop(slot);
+
+        return result;
+}
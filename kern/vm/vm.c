@@ -1,183 +1,1817 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <spl.h>
-#include <lib.h>
+#include <spinlock.h>
+#include <membar.h>
+#include <wchan.h>
 #include <synch.h>
+#include <lib.h>
+#include <cpu.h>
 #include <proc.h>
 #include <thread.h>
 #include <current.h>
+#include <uio.h>
+#include <vnode.h>
+#include <clock.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <slab.h>
+#include <vmstat.h>
 #include <machine/tlb.h>
 
-/* Place your page table functions here */
-struct page_table_entry **page_table = NULL;
-static size_t hpt_size = 0;
+/* Place your page table functions here */
+pt_link_t *page_table = NULL;
+static size_t hpt_size = 0;
+
+/*
+ * The hash chains are protected by a fixed set of striped spinlocks,
+ * chain i belonging to stripe i % PT_STRIPES. Each stripe also keeps a
+ * sequence count that is bumped on entry to and exit from every locked
+ * section (so it is odd while a chain may be changing), which lets
+ * vm_fault look up existing translations without taking any lock.
+ * Threads waiting for a page in transit to or from swap sleep on the
+ * stripe's wait channel.
+ */
+#define PT_STRIPES 64
+#define PT_PEEK_MAX 32          /* give up on a lock-free walk after this */
+#define EVICT_TRIES 8           /* clock picks to try before giving up */
+#define PREFETCH_RUN 2          /* sequential faults before reading ahead */
+#define PREFETCH_PAGES 8        /* pages read ahead at a time */
+
+struct pt_stripe {
+        struct spinlock lock;
+        volatile uint32_t seq;
+        struct wchan *wchan;
+};
+
+static struct pt_stripe pt_stripes[PT_STRIPES];
+
+#if OPT_IPT
+/*
+ * Inverted page table. Every entry lives in one array allocated at boot,
+ * IPT_PER_FRAME entries for each frame of memory (shared and zero page
+ * mappings take an entry each) plus one for each swap slot, and the hash
+ * chains link by index into it. When the array is full a fault fails
+ * with ENOMEM, as paging out frees no entries. Free entries are linked
+ * through as_next, leaving next for any walk still following it.
+ */
+#define IPT_PER_FRAME 2
+
+static struct page_table_entry *ipt = NULL;
+static size_t ipt_size = 0;
+static struct page_table_entry *ipt_free = NULL;
+static struct spinlock ipt_lock = SPINLOCK_INITIALIZER;
+
+#define PT_ENTRY(link)  ((link) == PT_NIL ? NULL : &ipt[(link)])
+#define PT_LINK(pte)    ((pte) == NULL ? PT_NIL : (pt_link_t) ((pte) - ipt))
+#else
+/*
+ * Page table entries come from their own object cache, which never
+ * gives memory back, so a lock-free walk that races with an unlink can
+ * only ever land on another entry (and the sequence count tells it to
+ * retry). Free entries are linked through as_next, leaving next for
+ * any walk still following it.
+ */
+static struct slab_cache pte_cache =
+        SLAB_CACHE_INITIALIZER("pte", struct page_table_entry, as_next);
+
+#define PT_ENTRY(link)  (link)
+#define PT_LINK(pte)    (pte)
+#endif
+
+/*
+ * A frame of zeros that every untouched page of anonymous memory is
+ * mapped to, read only, until it is first written. It holds a reference
+ * of its own, so it is never freed and always copied on write.
+ */
+static vaddr_t zero_page = 0;
+
+/*
+ * Fault-around. When faultaround_pages is 2 or more, a tlb miss also
+ * loads the other resident translations in the aligned window of that
+ * many pages around the fault, within the same region, so a sweep over
+ * resident memory takes one trap per window instead of one per page.
+ * Off (0) by default; set with vm_set_faultaround.
+ */
+static unsigned int faultaround_pages = 0;
+
+/*
+ * TLB shootdown. Changes to an address space's translations that other
+ * cpus must not miss are collected in a batch and sent only to the cpus
+ * that may hold its entries (see as_tlb_cpus); each drops them from its
+ * interrupt handler and raises its flag, and the sender waits for all
+ * of them. A batch of more than TLBSHOOTDOWN_MAX pages drops every entry
+ * of the address space instead. One batch is in flight at a time, so no
+ * cpu's shootdown queue can overflow. Batches are sent without holding
+ * any spinlock, since a cpu spinning with interrupts off never answers.
+ */
+struct tlb_batch {
+        struct addrspace *as;
+        unsigned int npages;            /* past TLBSHOOTDOWN_MAX means all */
+        vaddr_t pages[TLBSHOOTDOWN_MAX];
+};
+
+static struct lock *tlb_shootdown_lock = NULL;
+
+/*
+ * Pageout. Once an allocation leaves fewer than pageout_low frames free
+ * the pageout thread wakes and frees memory, PAGEOUT_BATCH pages at a
+ * time, until there are pageout_high: first cached pages, which need no
+ * writing, then user pages paged out by the clock. Faults only have to
+ * page out for themselves (in vm_alloc_page) when it falls behind.
+ */
+static unsigned int pageout_low = 0;
+static unsigned int pageout_high = 0;
+static struct wchan *pageout_wchan = NULL;
+static struct spinlock pageout_lock = SPINLOCK_INITIALIZER;
+
+static uint32_t
+hpt_hash(struct addrspace *as, vaddr_t faultaddr)
+{
+        uint32_t index;
+
+        index = (((uint32_t) as) ^ (faultaddr >> PAGE_BITS)) % hpt_size;
+        return index;
+}
+
+static struct pt_stripe *
+pt_lock(uint32_t hash)
+{
+        struct pt_stripe *stripe = &pt_stripes[hash % PT_STRIPES];
+
+        /* only a hint: the holder may be gone by the time we spin */
+        VMSTAT_INC(pt_locks);
+        if (spinlock_data_get(&stripe->lock.splk_lock) != 0) {
+                VMSTAT_INC(pt_contended);
+        }
+
+        spinlock_acquire(&stripe->lock);
+        stripe->seq++;
+        membar_store_store();
+
+        return stripe;
+}
+
+static void
+pt_unlock(struct pt_stripe *stripe)
+{
+        membar_store_store();
+        stripe->seq++;
+        spinlock_release(&stripe->lock);
+}
+
+/*
+ * Waits until pte is no longer in transit. The locked section is
+ * closed around the sleep so that the sequence count stays even for
+ * whoever takes the lock in the meantime.
+ */
+static void
+pt_wait(struct pt_stripe *stripe, struct page_table_entry *pte)
+{
+        while (pte->elo & PTE_BUSY) {
+                stripe->seq++;
+                wchan_sleep(stripe->wchan, &stripe->lock);
+                stripe->seq++;
+        }
+}
+
+static void
+page_table_init(unsigned int nframes)
+{
+        hpt_size = nframes * 2;
+        page_table = kmalloc(hpt_size * sizeof(pt_link_t));
+        if (page_table == NULL) {
+                panic("vm: no memory for the page table\n");
+        }
+        for (size_t i = 0; i < hpt_size; i++) {
+                page_table[i] = PT_NIL;
+        }
+
+#if OPT_IPT
+        ipt_size = nframes * IPT_PER_FRAME + swap_size();
+        ipt = kmalloc(ipt_size * sizeof(struct page_table_entry));
+        if (ipt == NULL) {
+                panic("vm: no memory for the inverted page table\n");
+        }
+        for (size_t i = ipt_size; i-- > 0; ) {
+                ipt[i].pid = 0;
+                ipt[i].elo = 0;
+                ipt[i].next = PT_NIL;
+                ipt[i].as_next = ipt_free;
+                ipt_free = &ipt[i];
+        }
+        kprintf("vm: inverted page table, %u entries (%u KB)\n",
+                (unsigned) ipt_size,
+                (unsigned) ((ipt_size * sizeof(struct page_table_entry) +
+                             hpt_size * sizeof(pt_link_t)) / 1024));
+#endif
+
+        for (size_t i = 0; i < PT_STRIPES; i++) {
+                spinlock_init(&pt_stripes[i].lock);
+                pt_stripes[i].seq = 0;
+                pt_stripes[i].wchan = wchan_create("pt_stripe");
+                if (pt_stripes[i].wchan == NULL) {
+                        panic("vm: could not create page table wchan\n");
+                }
+        }
+}
+
+/*
+ * Loads a translation for the current address space into the tlb,
+ * replacing any stale entry for it
+ */
+static void
+vm_tlb_load(struct addrspace *as, vaddr_t vaddr, uint32_t elo)
+{
+        int spl, index;
+        uint32_t ehi = vaddr | AS_ENTRYHI(as);
+
+        elo &= ~PTE_SOFT;
+
+        spl = splhigh();
+        index = tlb_probe(ehi, 0);
+        if (index >= 0) {
+                tlb_write(ehi, elo, index);
+        }
+        else {
+                tlb_random(ehi, elo);
+        }
+        splx(spl);
+
+        frame_set_referenced(elo & TLBLO_PPAGE);
+        if (elo & TLBLO_DIRTY) {
+                frame_set_dirty(elo & TLBLO_PPAGE);
+        }
+}
+
+/*
+ * Drops this cpu's tlb entry for vaddr under asid, or every entry under
+ * it if vaddr is TS_ALL. Entries of another ASID generation than this
+ * cpu's can never match again anyway, so they are left alone.
+ */
+static void
+vm_tlb_drop(uint32_t asid, vaddr_t vaddr)
+{
+        int spl, index;
+        uint32_t ehi, elo;
+        struct addrspace *curas;
+
+        spl = splhigh();
+
+        if ((asid & ~(NUM_ASID - 1)) != curcpu->c_asid_generation) {
+                splx(spl);
+                return;
+        }
+        asid &= NUM_ASID - 1;
+
+        if (vaddr != TS_ALL) {
+                index = tlb_probe(vaddr | (asid << TLBHI_PIDSHIFT), 0);
+                if (index >= 0) {
+                        tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+                }
+        }
+        else {
+                for (index = 0; index < NUM_TLB; index++) {
+                        tlb_read(&ehi, &elo, index);
+                        if ((elo & TLBLO_VALID) &&
+                            (ehi & TLBHI_PID) >> TLBHI_PIDSHIFT == asid) {
+                                tlb_write(TLBHI_INVALID(index),
+                                          TLBLO_INVALID(), index);
+                        }
+                }
+        }
+
+        /* put back the ASID we are running with */
+        curas = proc_getas();
+        if (curas != NULL) {
+                tlb_setasid(curas->asid & (NUM_ASID - 1));
+        }
+        splx(spl);
+}
+
+/* Drops as's translation for vaddr, if any, from this cpu's tlb */
+static void
+vm_tlb_invalidate(struct addrspace *as, vaddr_t vaddr)
+{
+        vm_tlb_drop(as->asid, vaddr);
+}
+
+static void
+tlb_batch_init(struct tlb_batch *tb, struct addrspace *as)
+{
+        tb->as = as;
+        tb->npages = 0;
+}
+
+/* Adds a page to the batch, or TS_ALL for all of the address space */
+static void
+tlb_batch_add(struct tlb_batch *tb, vaddr_t vaddr)
+{
+        if (tb->npages < TLBSHOOTDOWN_MAX) {
+                tb->pages[tb->npages] = vaddr;
+        }
+        if (tb->npages <= TLBSHOOTDOWN_MAX) {
+                tb->npages++;
+        }
+}
+
+/*
+ * Drops the batch's entries from every cpu that may hold them, this
+ * one included if LOCAL is set, and waits until they are gone. Must not
+ * be called with any spinlock held.
+ */
+static void
+tlb_batch_flush(struct tlb_batch *tb, bool local)
+{
+        int spl;
+        unsigned int i, npages;
+        uint32_t asid, cpus, self;
+        volatile bool done[MAXCPUS];
+        struct tlbshootdown ts;
+
+        if (tb->npages == 0) {
+                return;
+        }
+        if (tb->npages > TLBSHOOTDOWN_MAX) {
+                tb->pages[0] = TS_ALL;
+                tb->npages = 1;
+        }
+        npages = tb->npages;
+
+        cpus = as_tlb_cpus(tb->as, &asid);
+
+        spl = splhigh();
+        self = (uint32_t) 1 << curcpu->c_number;
+        if (local && (cpus & self)) {
+                for (i = 0; i < npages; i++) {
+                        vm_tlb_drop(asid, tb->pages[i]);
+                }
+        }
+        splx(spl);
+
+        cpus &= ~self;
+        if (cpus == 0) {
+                return;
+        }
+
+        lock_acquire(tlb_shootdown_lock);
+
+        for (i = 0; i < MAXCPUS; i++) {
+                done[i] = false;
+        }
+
+        ts.ts_asid = asid;
+        for (i = 0; i < npages; i++) {
+                ts.ts_vaddr = tb->pages[i];
+                /* queues are handled in order, so the last one tells */
+                ts.ts_done = (i == npages - 1) ? done : NULL;
+                ipi_tlbshootdown_cpus(cpus, &ts);
+        }
+
+        for (i = 0; i < MAXCPUS; i++) {
+                if (cpus & ((uint32_t) 1 << i)) {
+                        while (!done[i]) {
+                                /* spin */
+                        }
+                }
+        }
+
+        lock_release(tlb_shootdown_lock);
+}
+
+/* Drops every tlb entry of as, on every cpu */
+void
+vm_tlbflush(struct addrspace *as)
+{
+        struct tlb_batch tb;
+
+        tlb_batch_init(&tb, as);
+        tlb_batch_add(&tb, TS_ALL);
+        tlb_batch_flush(&tb, true);
+}
+
+/* 
+ * Counts NPAGES more (or fewer) resident pages in as, noting whether
+ * they went because they were paged out. The evictor calls this too,
+ * with the entry's stripe lock keeping as alive.
+ */
+static void
+page_account(struct addrspace *as, int npages, bool pagedout)
+{
+        spinlock_acquire(&as->usage_lock);
+        as->usage.rss += npages;
+        if (as->usage.rss > as->usage.maxrss) {
+                as->usage.maxrss = as->usage.rss;
+        }
+        if (pagedout) {
+                as->usage.nswap++;
+        }
+        spinlock_release(&as->usage_lock);
+}
+
+/*
+ * Pages out one unshared user page chosen by the frame table's clock,
+ * putting its frame back on the free list. The victim's entry is
+ * marked PTE_BUSY while the write is in flight, and anyone touching
+ * it waits on the stripe's wait channel. A clean page that still has
+ * its copy on swap is just dropped, which works even with swap full.
+ * Must not be called with any spinlock held, as it sleeps on the disk.
+ */
+static int
+page_evict(void)
+{
+        int result;
+        bool dirty, clean, haveslot;
+        unsigned int slot, oldslot, tries;
+        paddr_t paddr;
+        vaddr_t vpn;
+        uint32_t pid, elo;
+        struct pt_stripe *stripe;
+        struct page_table_entry *pte;
+        struct tlb_batch tb;
+
+        haveslot = (swap_alloc(&slot) == 0);
+
+        for (tries = 0; tries < EVICT_TRIES; tries++) {
+                if (!frame_clock_select(&paddr, &pte)) {
+                        break;
+                }
+
+                /* the entry may have changed since the clock saw it */
+                pid = pte->pid;
+                vpn = pte->vpn;
+                stripe = pt_lock(hpt_hash((struct addrspace *) pid, vpn));
+                if (pte->pid != pid || pte->vpn != vpn) {
+                        pt_unlock(stripe);
+                        continue;
+                }
+                if ((pte->elo & (TLBLO_PPAGE | TLBLO_VALID)) !=
+                    (paddr | TLBLO_VALID)) {
+                        pt_unlock(stripe);
+                        continue;
+                }
+                if (!frame_claim(paddr, pte, &dirty)) {
+                        pt_unlock(stripe);
+                        continue;
+                }
+
+                /* a page not writable since it came in matches its slot */
+                elo = pte->elo;
+                oldslot = pte->slot;
+                clean = !dirty && !(elo & TLBLO_DIRTY) &&
+                        oldslot != PTE_NOSLOT;
+                if (!clean && !haveslot) {
+                        pt_unlock(stripe);
+                        frame_unclaim(paddr);
+                        continue;
+                }
+
+                pte->elo = ((clean ? oldslot : slot) << PAGE_BITS) |
+                           (elo & TLBLO_DIRTY) | PTE_SWAPPED | PTE_BUSY;
+                pte->slot = PTE_NOSLOT;
+                pt_unlock(stripe);
+
+                /* nobody may write to the page while it is written out */
+                tlb_batch_init(&tb, (struct addrspace *) pid);
+                tlb_batch_add(&tb, vpn);
+                tlb_batch_flush(&tb, true);
+
+                result = clean ? 0 : swap_write(slot, paddr);
+
+                stripe = pt_lock(hpt_hash((struct addrspace *) pid, vpn));
+                if (result) {
+                        pte->elo = elo;
+                        pte->slot = oldslot;
+                }
+                else {
+                        pte->elo &= ~PTE_BUSY;
+                        page_account((struct addrspace *) pid, -1, true);
+                        VMSTAT_INC(pageouts);
+                        if (clean) {
+                                VMSTAT_INC(pageouts_clean);
+                        }
+                }
+                wchan_wakeall(stripe->wchan, &stripe->lock);
+                pt_unlock(stripe);
+
+                if (result) {
+                        frame_unclaim(paddr);
+                        swap_free(slot);
+                        return result;
+                }
+
+                if (clean) {
+                        if (haveslot) {
+                                swap_free(slot);
+                        }
+                }
+                else if (oldslot != PTE_NOSLOT) {
+                        /* the page changed since it was last swapped in */
+                        swap_free(oldslot);
+                }
+                free_kpages(PADDR_TO_KVADDR(paddr));
+                return 0;
+        }
+
+        if (haveslot) {
+                swap_free(slot);
+        }
+        return ENOMEM;
+}
+
+/* Wakes the pageout thread if free memory has run low */
+void
+pageout_kick(void)
+{
+        if (pageout_wchan == NULL || frame_free_count() >= pageout_low) {
+                return;
+        }
+
+        spinlock_acquire(&pageout_lock);
+        wchan_wakeone(pageout_wchan, &pageout_lock);
+        spinlock_release(&pageout_lock);
+}
+
+/*
+ * The pageout thread. If nothing at all can be freed it backs off for a
+ * second, rather than being woken straight back up by every allocation.
+ */
+static void
+pageout_thread(void *data1, unsigned long data2)
+{
+        unsigned int i;
+        bool stuck;
+
+        (void) data1;
+        (void) data2;
+
+        while (true) {
+                spinlock_acquire(&pageout_lock);
+                while (frame_free_count() >= pageout_low) {
+                        wchan_sleep(pageout_wchan, &pageout_lock);
+                }
+                spinlock_release(&pageout_lock);
+
+                stuck = false;
+                while (!stuck && frame_free_count() < pageout_high) {
+                        for (i = 0; i < PAGEOUT_BATCH; i++) {
+                                if (frame_free_count() >= pageout_high) {
+                                        break;
+                                }
+                                if (page_cache_shrink(false) ||
+                                    swap_cache_shrink()) {
+                                        continue;
+                                }
+                                if (page_evict()) {
+                                        stuck = true;
+                                        break;
+                                }
+                        }
+                        thread_yield();
+                }
+
+                if (stuck) {
+                        clocksleep(1);
+                }
+        }
+}
+
+/* Starts the pageout thread, once threads can be forked */
+static void
+pageout_bootstrap(unsigned int nframes)
+{
+        int result;
+
+        /* as for the zero pool, keep a small machine's watermarks low */
+        pageout_high = nframes / 32;
+        if (pageout_high > PAGEOUT_HIGH) {
+                pageout_high = PAGEOUT_HIGH;
+        }
+        pageout_low = pageout_high / 2;
+        if (pageout_low > PAGEOUT_LOW) {
+                pageout_low = PAGEOUT_LOW;
+        }
+
+        pageout_wchan = wchan_create("pageout");
+        if (pageout_wchan == NULL) {
+                panic("vm: could not create pageout wchan\n");
+        }
+
+        result = thread_fork("pageout", NULL, pageout_thread, NULL, 0);
+        if (result) {
+                panic("vm: could not start pageout thread: %s\n",
+                      strerror(result));
+        }
+}
+
+/* 
+ * Allocates a frame for a user page, paging something out if need be.
+ * Callers that fill the whole page themselves can skip the zeroing.
+ */
+static vaddr_t
+vm_alloc_page(bool zero)
+{
+        vaddr_t vaddr;
+
+        while ((vaddr = zero ? alloc_kpages(1) : alloc_kpages_nozero(1)) == 0) {
+                /* 
+                 * cached text nobody maps is the cheapest to give up,
+                 * and dropping the rest of the cache may leave frames
+                 * the clock can page out
+                 */
+                if (page_cache_shrink(false) || swap_cache_shrink()) {
+                        continue;
+                }
+                if (page_evict() && !page_cache_shrink(true)) {
+                        return 0;
+                }
+        }
+
+        return vaddr;
+}
+
+/* Gets an unused page table entry, or NULL if there is none to be had */
+static struct page_table_entry *
+pte_alloc(void)
+{
+        struct page_table_entry *pte;
+
+#if OPT_IPT
+        spinlock_acquire(&ipt_lock);
+        pte = ipt_free;
+        if (pte != NULL) {
+                ipt_free = pte->as_next;
+        }
+        spinlock_release(&ipt_lock);
+#else
+        while ((pte = slab_alloc(&pte_cache)) == NULL) {
+                /* make room in the kernel heap */
+                if (page_evict()) {
+                        return NULL;
+                }
+        }
+#endif
+
+        return pte;
+}
+
+static void
+pte_free(struct page_table_entry *pte)
+{
+#if OPT_IPT
+        spinlock_acquire(&ipt_lock);
+        pte->as_next = ipt_free;
+        ipt_free = pte;
+        spinlock_release(&ipt_lock);
+#else
+        slab_free(&pte_cache, pte);
+#endif
+}
+
+/*
+ * Adds a translation for faultaddr to the hashed page table and to the
+ * address space's page list. Only the thread running in (or creating)
+ * the address space adds or removes its pages, so as->pages itself
+ * needs no lock.
+ */
+static struct page_table_entry *
+page_table_insert(struct addrspace *as, vaddr_t faultaddr, uint32_t elo)
+{
+        struct page_table_entry *pte;
+        struct pt_stripe *stripe;
+        uint32_t hash = hpt_hash(as, faultaddr);
+
+        pte = pte_alloc();
+        if (pte == NULL) {
+                return NULL;
+        }
+
+        pte->pid = (uint32_t) as;
+        pte->vpn = faultaddr;
+        pte->elo = elo;
+        pte->rmap_next = NULL;
+        pte->slot = PTE_NOSLOT;
+
+        stripe = pt_lock(hash);
+        pte->next = page_table[hash];
+        membar_store_store();
+        page_table[hash] = PT_LINK(pte);
+        pt_unlock(stripe);
+
+        pte->as_next = as->pages;
+        as->pages = pte;
+
+        if (elo & TLBLO_VALID) {
+                page_account(as, 1, false);
+        }
+
+        return pte;
+}
+
+/* Called with the stripe lock for faultaddr's chain held */
+static struct page_table_entry *
+page_table_get(struct addrspace *as, vaddr_t faultaddr)
+{
+        uint32_t pid, hash;
+        struct page_table_entry *curr;
+
+        pid = (uint32_t) as;
+        hash = hpt_hash(as, faultaddr);
+
+        for (curr = PT_ENTRY(page_table[hash]); curr != NULL;
+             curr = PT_ENTRY(curr->next)) {
+                if (curr->pid == pid && curr->vpn == faultaddr) {
+                        return curr;
+                }
+        }
+
+        return NULL;
+}
+
+/*
+ * Lock-free version of page_table_get, returning a snapshot of the
+ * entrylo (0 if there is no translation) and the stripe's sequence
+ * count it was taken under. Returns false if the chain changed during
+ * the walk, in which case the caller must fall back to a locked
+ * lookup.
+ */
+static bool
+page_table_peek(struct addrspace *as, vaddr_t faultaddr,
+                uint32_t *elo, uint32_t *seq)
+{
+        uint32_t pid, hash;
+        unsigned int steps;
+        struct pt_stripe *stripe;
+        struct page_table_entry *curr;
+
+        pid = (uint32_t) as;
+        hash = hpt_hash(as, faultaddr);
+        stripe = &pt_stripes[hash % PT_STRIPES];
+
+        *seq = stripe->seq;
+        if (*seq & 1) {
+                return false;
+        }
+        membar_load_load();
+
+        *elo = 0;
+        steps = 0;
+        for (curr = PT_ENTRY(page_table[hash]); curr != NULL;
+             curr = PT_ENTRY(curr->next)) {
+                if (curr->pid == pid && curr->vpn == faultaddr) {
+                        *elo = curr->elo;
+                        break;
+                }
+                if (++steps == PT_PEEK_MAX) {
+                        return false;
+                }
+        }
+
+        membar_load_load();
+        return stripe->seq == *seq;
+}
+
+/*
+ * Preloads the resident neighbours of faultaddress (see faultaround_pages)
+ * into free tlb slots, or random ones once those run out. Entries are
+ * loaded as they stand, so writes to clean or shared pages still fault.
+ * The neighbours are not marked referenced, since nothing has touched
+ * them yet.
+ */
+static void
+vm_faultaround(struct addrspace *as, vaddr_t faultaddress)
+{
+        int spl;
+        unsigned int i, npages, nfree, used, loaded;
+        unsigned int free_slots[FAULT_AROUND_MAX];
+        uint32_t ehi, elo, seq;
+        vaddr_t vaddr, start, end;
+        struct region *region;
+        struct pt_stripe *stripe;
+
+        npages = faultaround_pages;
+        if (npages < 2 || as->load) {
+                return;
+        }
+
+        region = as_find_region(as, faultaddress);
+        if (region == NULL) {
+                return;
+        }
+
+        start = faultaddress - 
+                ((faultaddress / PAGE_SIZE) % npages) * PAGE_SIZE;
+        end = start + npages * PAGE_SIZE;
+        if (start < region->vbase) {
+                start = region->vbase;
+        }
+        if (end > region->vbase + region->size) {
+                end = region->vbase + region->size;
+        }
+
+        spl = splhigh();
+
+        nfree = 0;
+        for (i = 0; i < NUM_TLB && nfree < npages; i++) {
+                tlb_read(&ehi, &elo, i);
+                if (!(elo & TLBLO_VALID)) {
+                        free_slots[nfree++] = i;
+                }
+        }
+        /* tlb_read left the last entry's ASID in entryhi */
+        tlb_setasid(as->asid & (NUM_ASID - 1));
+
+        used = 0;
+        loaded = 0;
+        for (vaddr = start; vaddr < end; vaddr += PAGE_SIZE) {
+                if (vaddr == faultaddress) {
+                        continue;
+                }
+                if (!page_table_peek(as, vaddr, &elo, &seq) ||
+                    !(elo & TLBLO_VALID)) {
+                        continue;
+                }
+
+                /* a duplicate entry would be fatal */
+                ehi = vaddr | AS_ENTRYHI(as);
+                if (tlb_probe(ehi, 0) >= 0) {
+                        continue;
+                }
+
+                elo &= ~PTE_SOFT;
+                if (used < nfree) {
+                        tlb_write(ehi, elo, free_slots[used++]);
+                }
+                else {
+                        tlb_random(ehi, elo);
+                }
+
+                stripe = &pt_stripes[hpt_hash(as, vaddr) % PT_STRIPES];
+                membar_load_load();
+                if (stripe->seq != seq) {
+                        vm_tlb_invalidate(as, vaddr);
+                        continue;
+                }
+                if (elo & TLBLO_DIRTY) {
+                        frame_set_dirty(elo & TLBLO_PPAGE);
+                }
+                loaded++;
+        }
+
+        splx(spl);
+
+        VMSTAT_ADD(faultaround_loads, loaded);
+}
+
+/*
+ * Measures the hash chains for vmstat. Each stripe's chains are walked
+ * under its lock, which is only read under, so the sequence count is
+ * left alone and lock-free lookups carry on undisturbed.
+ */
+void
+page_table_chains(struct pt_chain_stats *stats)
+{
+        unsigned int i, len;
+        size_t hash;
+        struct pt_stripe *stripe;
+        struct page_table_entry *curr;
+
+        stats->buckets = hpt_size;
+        stats->used = 0;
+        stats->entries = 0;
+        stats->longest = 0;
+
+        for (i = 0; i < PT_STRIPES; i++) {
+                stripe = &pt_stripes[i];
+                spinlock_acquire(&stripe->lock);
+                for (hash = i; hash < hpt_size; hash += PT_STRIPES) {
+                        len = 0;
+                        for (curr = PT_ENTRY(page_table[hash]); curr != NULL;
+                             curr = PT_ENTRY(curr->next)) {
+                                len++;
+                        }
+                        if (len > 0) {
+                                stats->used++;
+                        }
+                        if (len > stats->longest) {
+                                stats->longest = len;
+                        }
+                        stats->entries += len;
+                }
+                spinlock_release(&stripe->lock);
+        }
+}
+
+/* Sets the fault-around window, in pages; 0 or 1 turns it off */
+void
+vm_set_faultaround(unsigned int npages)
+{
+        if (npages > FAULT_AROUND_MAX) {
+                npages = FAULT_AROUND_MAX;
+        }
+        faultaround_pages = npages;
+}
+
+void
+vm_print_faultaround(void)
+{
+        struct vmstat vs;
+
+        vmstat_sum(&vs);
+        kprintf("fault-around: %u pages, %u tlb misses, "
+                "%u entries preloaded\n", faultaround_pages,
+                vs.tlb_misses, vs.faultaround_loads);
+}
+
+/*
+ * Gives newas its own resident copy of a page oldas has on swap.
+ * Swap slots are not shared, so the child gets a frame straight away.
+ */
+static int
+page_table_copy_swapped(struct addrspace *newas, vaddr_t vpn, uint32_t elo)
+{
+        int result;
+        vaddr_t vaddr;
+        struct page_table_entry *new;
+
+        vaddr = vm_alloc_page(false);
+        if (vaddr == 0) {
+                return ENOMEM;
+        }
+
+        result = swap_read(PTE_SLOT(elo), KVADDR_TO_PADDR(vaddr));
+        if (result) {
+                free_kpages(vaddr);
+                return result;
+        }
+
+        new = page_table_insert(newas, vpn, KVADDR_TO_PADDR(vaddr) |
+                                TLBLO_VALID | (elo & TLBLO_DIRTY));
+        if (new == NULL) {
+                free_kpages(vaddr);
+                return ENOMEM;
+        }
+
+        frame_set_user(KVADDR_TO_PADDR(vaddr), new);
+        return 0;
+}
+
+/*
+ * Shares every page of oldas with newas copy-on-write. Both mappings
+ * lose TLBLO_DIRTY so the first write from either side traps into
+ * vm_fault, which makes the private copy.
+ */
+int
+page_table_copy(struct addrspace *oldas, struct addrspace *newas)
+{
+        int result;
+        uint32_t elo;
+        struct pt_stripe *stripe;
+        struct page_table_entry *curr, *new;
+
+        for (curr = oldas->pages; curr != NULL; curr = curr->as_next) {
+                stripe = pt_lock(hpt_hash(oldas, curr->vpn));
+                pt_wait(stripe, curr);
+                if (curr->elo & TLBLO_VALID) {
+                        curr->elo &= ~TLBLO_DIRTY;
+                        frame_ref(curr->elo & TLBLO_PPAGE);
+                }
+                elo = curr->elo;
+                pt_unlock(stripe);
+
+                if (elo & PTE_SWAPPED) {
+                        result = page_table_copy_swapped(newas, curr->vpn, elo);
+                        if (result) {
+                                return result;
+                        }
+                        continue;
+                }
+
+                new = page_table_insert(newas, curr->vpn, elo);
+                if (new == NULL) {
+                        free_kpages(PADDR_TO_KVADDR(elo & TLBLO_PPAGE));
+                        return ENOMEM;
+                }
+                if (PADDR_TO_KVADDR(elo & TLBLO_PPAGE) != zero_page) {
+                        frame_add_owner(elo & TLBLO_PPAGE, new);
+                }
+        }
+
+        return 0;
+}
+
+/*
+ * Unlinks a single entry from its hash chain, waiting for any page out
+ * in progress first. Hands back the entry's last elo.
+ */
+static uint32_t
+page_table_unlink(struct page_table_entry *pte)
+{
+        uint32_t hash, elo;
+        struct pt_stripe *stripe;
+        pt_link_t *prev;
+
+        hash = hpt_hash((struct addrspace *) pte->pid, pte->vpn);
+
+        stripe = pt_lock(hash);
+        pt_wait(stripe, pte);
+        for (prev = &page_table[hash]; *prev != PT_LINK(pte);
+             prev = &PT_ENTRY(*prev)->next) {
+                KASSERT(*prev != PT_NIL);
+        }
+        *prev = pte->next;
+
+        /* so the page replacement clock can tell it is gone */
+        elo = pte->elo;
+        pte->elo = 0;
+        pt_unlock(stripe);
+
+        return elo;
+}
+
+/* Drops a page's translation, and its frame or swap slot, for good */
+static void
+page_table_release(struct page_table_entry *pte)
+{
+        uint32_t elo;
+
+        elo = page_table_unlink(pte);
+        if (elo & PTE_SWAPPED) {
+                swap_free(PTE_SLOT(elo));
+        }
+        else {
+                frame_disown(elo & TLBLO_PPAGE, pte);
+                free_kpages(PADDR_TO_KVADDR(elo & TLBLO_PPAGE));
+                page_account((struct addrspace *) pte->pid, -1, false);
+        }
+        if (pte->slot != PTE_NOSLOT) {
+                swap_free(pte->slot);
+        }
+        pte_free(pte);
+}
+
+void
+page_table_remove(struct addrspace *as)
+{
+        struct page_table_entry *curr, *next;
+
+        for (curr = as->pages; curr != NULL; curr = next) {
+                next = curr->as_next;
+                page_table_release(curr);
+        }
+        as->pages = NULL;
+}
+
+/* 
+ * Drops the pages of as in [start, end), and any tlb entries for them.
+ * The address space only runs in the calling thread, so nothing uses
+ * the entries before they are shot down, after the frames are freed.
+ */
+void
+page_table_remove_range(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+        struct page_table_entry **prev, *curr;
+        struct tlb_batch tb;
 
-static struct lock *pt_lock;
+        tlb_batch_init(&tb, as);
 
-static uint32_t
-hpt_hash(struct addrspace *as, vaddr_t faultaddr) 
+        prev = &as->pages;
+        while ((curr = *prev) != NULL) {
+                if (curr->vpn < start || curr->vpn >= end) {
+                        prev = &curr->as_next;
+                        continue;
+                }
+                *prev = curr->as_next;
+                tlb_batch_add(&tb, curr->vpn);
+                page_table_release(curr);
+        }
+
+        tlb_batch_flush(&tb, true);
+}
+
+void vm_bootstrap(void)
 {
-        uint32_t index;
+        unsigned int nframes;
+        paddr_t top_of_ram = ram_getsize();
 
-        index = (((uint32_t) as) ^ (faultaddr >> PAGE_BITS)) % hpt_size;
-        return index;
+        nframes = top_of_ram / PAGE_SIZE;
+
+        frame_table = kmalloc(nframes * sizeof(struct frame_table_entry));
+        frame_table_init(nframes);
+
+        /* the inverted page table is sized by swap as well */
+        swap_bootstrap(nframes);
+        page_table_init(nframes);
+
+        zero_page = alloc_kpages(1);
+        if (zero_page == 0) {
+                panic("vm: no memory for the zero page\n");
+        }
+
+        tlb_shootdown_lock = lock_create("tlb shootdown");
+        if (tlb_shootdown_lock == NULL) {
+                panic("vm: could not create tlb shootdown lock\n");
+        }
+
+        frame_zero_bootstrap();
+        prefetch_bootstrap();
+        pageout_bootstrap(nframes);
+        vmstat_bootstrap();
 }
 
-static void 
-page_table_init(void) 
+/*
+ * Brings a swapped out page back in. The caller has marked the entry
+ * PTE_BUSY, so nothing else touches it while we sleep on the disk.
+ * After a read the page comes back read-only and keeps its slot, so it
+ * can go out again for free until a write faults and drops the slot;
+ * unless the slot was compressed in memory, where keeping it would
+ * fill the pool with copies of resident pages.
+ */
+static int
+page_swapin(struct addrspace *as, struct page_table_entry *pte,
+            int faulttype, vaddr_t faultaddress)
 {
-        for (size_t i = 0; i < hpt_size; i++) {
-                page_table[i] = NULL;
+        int result;
+        bool keep, cached;
+        uint32_t elo;
+        paddr_t paddr;
+        vaddr_t vaddr;
+        unsigned int slot;
+        struct pt_stripe *stripe;
+
+        slot = PTE_SLOT(pte->elo);
+
+        /* the page may have been read ahead already */
+        result = 0;
+        paddr = swap_cache_take(slot);
+        cached = (paddr != 0);
+        if (cached) {
+                vaddr = PADDR_TO_KVADDR(paddr);
+        }
+        else {
+                result = ENOMEM;
+                vaddr = vm_alloc_page(false);
+                if (vaddr != 0) {
+                        result = swap_read(slot, KVADDR_TO_PADDR(vaddr));
+                }
+        }
+
+        /* the loader writes through read-only mappings */
+        keep = (faulttype == VM_FAULT_READ && !as->load &&
+                swap_keepable(slot));
+
+        stripe = pt_lock(hpt_hash(as, faultaddress));
+        if (result == 0) {
+                pte->elo = KVADDR_TO_PADDR(vaddr) | TLBLO_VALID |
+                           (keep ? 0 : (pte->elo & TLBLO_DIRTY));
+                pte->slot = keep ? slot : PTE_NOSLOT;
+                elo = as->load ? (pte->elo | TLBLO_DIRTY) : pte->elo;
+                vm_tlb_load(as, faultaddress, elo);
+        }
+        else {
+                pte->elo &= ~PTE_BUSY;
         }
+        wchan_wakeall(stripe->wchan, &stripe->lock);
+        pt_unlock(stripe);
+
+        if (result) {
+                if (vaddr != 0) {
+                        free_kpages(vaddr);
+                }
+                return result;
+        }
+
+        if (!keep) {
+                swap_free(slot);
+        }
+        frame_set_user(KVADDR_TO_PADDR(vaddr), pte);
+        page_account(as, 1, false);
+        VMSTAT_INC(swapins);
+        if (cached) {
+                VMSTAT_INC(swapins_cached);
+                as->usage.minflt++;
+        }
+        else {
+                as->usage.majflt++;
+        }
+
+        return 0;
 }
 
-static struct page_table_entry *
-page_table_insert(struct addrspace *as, vaddr_t faultaddr, uint32_t perms) 
+/*
+ * Gives the faulting address space its own writable copy of a shared
+ * copy-on-write page. The last sharer simply takes the frame over.
+ * The copy is made without holding the stripe lock; our reference
+ * keeps the old frame alive, and no sharer writes to it while it is
+ * still shared. If the page was paged out from under us in the
+ * meantime, we give up and let the access fault again.
+ */
+static int
+page_table_cow(struct addrspace *as, vaddr_t faultaddress)
 {
         vaddr_t vaddr;
+        paddr_t oldframe;
+        unsigned int slot;
+        struct pt_stripe *stripe;
         struct page_table_entry *pte;
-        uint32_t hash = hpt_hash(as, faultaddr);
+        struct tlb_batch tb;
+        uint32_t hash = hpt_hash(as, faultaddress);
 
-        pte = kmalloc(sizeof(struct page_table_entry));
-        if (pte == NULL) {
-                return NULL;
+        stripe = pt_lock(hash);
+        pte = page_table_get(as, faultaddress);
+        KASSERT(pte != NULL);
+        if (!(pte->elo & TLBLO_VALID)) {
+                pt_unlock(stripe);
+                return 0;
         }
+        oldframe = pte->elo & TLBLO_PPAGE;
+        pt_unlock(stripe);
 
-        /* allocate a frame */
-        vaddr = alloc_kpages(1);
+        /* sharers only ever drop out, so a sole owner stays that way */
+        vaddr = 0;
+        if (PADDR_TO_KVADDR(oldframe) == zero_page) {
+                vaddr = vm_alloc_page(true);
+                if (vaddr == 0) {
+                        return ENOMEM;
+                }
+        }
+        else if (frame_refcount(oldframe) > 1) {
+                vaddr = vm_alloc_page(false);
+                if (vaddr == 0) {
+                        return ENOMEM;
+                }
 
-        pte->pid = (uint32_t) as;
-        pte->vpn = faultaddr;
-        pte->elo = KVADDR_TO_PADDR(vaddr) | perms; 
+                memmove((void *) vaddr,
+                        (void *) PADDR_TO_KVADDR(oldframe),
+                        PAGE_SIZE);
+        }
 
-        pte->next = page_table[hash];
-        page_table[hash] = pte;
+        stripe = pt_lock(hash);
+        if ((pte->elo & (TLBLO_PPAGE | TLBLO_VALID)) !=
+            (oldframe | TLBLO_VALID)) {
+                pt_unlock(stripe);
+                if (vaddr != 0) {
+                        free_kpages(vaddr);
+                }
+                return 0;
+        }
+        if (vaddr != 0) {
+                pte->elo = KVADDR_TO_PADDR(vaddr) | (pte->elo & ~TLBLO_PPAGE);
+        }
+        pte->elo |= TLBLO_DIRTY;
+        vm_tlb_load(as, faultaddress, pte->elo);
 
-        return pte;
+        /* the copy on swap is about to go stale */
+        slot = pte->slot;
+        pte->slot = PTE_NOSLOT;
+        pt_unlock(stripe);
+
+        if (slot != PTE_NOSLOT) {
+                swap_free(slot);
+        }
+
+        as->usage.minflt++;
+        if (vaddr != 0 && PADDR_TO_KVADDR(oldframe) != zero_page) {
+                as->usage.cowflt++;
+                VMSTAT_INC(cow_copies);
+        }
+
+        if (vaddr != 0) {
+                /* cpus we ran on before may still map the old frame */
+                tlb_batch_init(&tb, as);
+                tlb_batch_add(&tb, faultaddress);
+                tlb_batch_flush(&tb, false);
+
+                frame_disown(oldframe, pte);
+                free_kpages(PADDR_TO_KVADDR(oldframe));
+                frame_set_user(KVADDR_TO_PADDR(vaddr), pte);
+        }
+        else {
+                frame_set_user(oldframe, pte);
+        }
+
+        return 0;
 }
 
-static struct page_table_entry *
-page_table_get(struct addrspace *as, vaddr_t faultaddr) 
+/*
+ * Works out which bytes of the page at faultaddress come from the file
+ * backing region, clipping [*start, *end) to them. Returns false if
+ * none do.
+ */
+static bool
+region_file_span(struct region *region, vaddr_t faultaddress,
+                 vaddr_t *start, vaddr_t *end)
 {
-        uint32_t pid, hash;
-        struct page_table_entry *curr;
+        vaddr_t fend;
 
-        pid = (uint32_t) as;
-        hash = hpt_hash(as, faultaddr);
+        if (region->vnode == NULL) {
+                return false;
+        }
 
-        for (curr = page_table[hash]; curr != NULL; curr = curr->next) {
-                if (curr->pid == pid && curr->vpn == faultaddr) {
-                        return curr;
+        fend = region->filebase + region->filesize;
+        *start = faultaddress;
+        *end = faultaddress + PAGE_SIZE;
+        if (*start < region->filebase) {
+                *start = region->filebase;
+        }
+        if (*end > fend) {
+                *end = fend;
+        }
+
+        return *start < *end;
+}
+
+/* Number of bytes of the page at faultaddress backed by files */
+static size_t
+page_file_bytes(struct addrspace *as, vaddr_t faultaddress)
+{
+        unsigned i, n;
+        size_t bytes = 0;
+        vaddr_t start, end;
+        struct region *regions[AS_PAGE_REGIONS];
+
+        n = as_page_regions(as, faultaddress, regions);
+        for (i = 0; i < n; i++) {
+                if (region_file_span(regions[i], faultaddress, &start, &end)) {
+                        bytes += end - start;
                 }
         }
 
-        return NULL;
+        return bytes;
 }
 
-static struct region *
-region_get(struct addrspace *as, vaddr_t faultaddress)
+/*
+ * Reads the file backed parts of the page at faultaddress into the
+ * frame at vaddr. Segments need not be page aligned, so a page can hold
+ * the end of one segment and the start of the next; the rest of the 
+ * page is left as the caller allocated it.
+ */
+static int
+page_read_file(struct addrspace *as, vaddr_t faultaddress, vaddr_t vaddr)
 {
-        vaddr_t vtop;
+        int result;
+        struct iovec iov;
+        struct uio ku;
+        unsigned i, n;
+        vaddr_t start, end;
         struct region *curr;
+        struct region *regions[AS_PAGE_REGIONS];
 
-        for (curr = as->regions; curr != NULL; curr = curr->next) {
-                vtop = curr->vbase + curr->size;
-                if (faultaddress >= curr->vbase && faultaddress < vtop) {
-                        return curr;
+        n = as_page_regions(as, faultaddress, regions);
+        for (i = 0; i < n; i++) {
+                curr = regions[i];
+                if (!region_file_span(curr, faultaddress, &start, &end)) {
+                        continue;
+                }
+
+                uio_kinit(&iov, &ku, (void *) (vaddr + start - faultaddress),
+                          end - start,
+                          curr->offset + (start - curr->filebase), UIO_READ);
+                result = VOP_READ(curr->vnode, &ku);
+                if (result) {
+                        return result;
+                }
+                if (ku.uio_resid != 0) {
+                        return EIO;
                 }
         }
 
-        return NULL;
+        return 0;
+}
+
+/*
+ * Fills the private page at vaddr from the page cache, if the page is
+ * there (because it was read ahead, say). Only a page whose file data
+ * all comes from the one region can be cached.
+ */
+static bool
+page_copy_cached(struct region *region, vaddr_t faultaddress,
+                 size_t filebytes, vaddr_t vaddr)
+{
+        paddr_t paddr;
+        vaddr_t start, end;
+
+        if (!region_file_span(region, faultaddress, &start, &end) ||
+            end - start != filebytes) {
+                return false;
+        }
+
+        paddr = page_cache_lookup(region->vnode, 
+                                  region->offset + (start - region->filebase),
+                                  start - faultaddress, end - start);
+        if (paddr == 0) {
+                return false;
+        }
+
+        memmove((void *) vaddr, (void *) PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+        free_kpages(PADDR_TO_KVADDR(paddr));
+        return true;
+}
+
+/* Queues the page at vaddr to be read ahead, from swap or the file */
+static void
+vm_readahead_page(struct addrspace *as, struct region *region, vaddr_t vaddr)
+{
+        bool swapped;
+        unsigned int slot;
+        vaddr_t start, end;
+        struct pt_stripe *stripe;
+        struct page_table_entry *pte;
+
+        swapped = false;
+        slot = 0;
+        stripe = pt_lock(hpt_hash(as, vaddr));
+        pte = page_table_get(as, vaddr);
+        if (pte != NULL &&
+            (pte->elo & (PTE_SWAPPED | PTE_BUSY)) == PTE_SWAPPED) {
+                swapped = true;
+                slot = PTE_SLOT(pte->elo);
+        }
+        pt_unlock(stripe);
+
+        if (swapped) {
+                prefetch_swap(slot);
+        }
+        else if (pte == NULL && 
+                 region_file_span(region, vaddr, &start, &end) &&
+                 end - start == page_file_bytes(as, vaddr)) {
+                prefetch_file(region->vnode,
+                              region->offset + (start - region->filebase),
+                              start - vaddr, end - start);
+        }
+}
+
+/*
+ * Called after a fault that had to read the page in. Once a region has
+ * faulted PREFETCH_RUN pages in a row, the next PREFETCH_PAGES are read
+ * ahead, and the next lot again whenever the faults are half way into
+ * what has been read ahead, so the reads keep ahead of the process.
+ */
+static void
+vm_readahead(struct addrspace *as, struct region *region,
+             vaddr_t faultaddress)
+{
+        vaddr_t vaddr, start, end;
+
+        if (faultaddress == region->ra_next) {
+                region->ra_run++;
+        }
+        else {
+                region->ra_run = 1;
+                region->ra_end = 0;
+        }
+        region->ra_next = faultaddress + PAGE_SIZE;
+
+        if (region->ra_run < PREFETCH_RUN ||
+            faultaddress + (PREFETCH_PAGES / 2) * PAGE_SIZE < region->ra_end) {
+                return;
+        }
+
+        start = faultaddress + PAGE_SIZE;
+        if (region->ra_end > start) {
+                start = region->ra_end;
+        }
+        end = start + PREFETCH_PAGES * PAGE_SIZE;
+        if (end > region->vbase + region->size) {
+                end = region->vbase + region->size;
+        }
+
+        for (vaddr = start; vaddr < end; vaddr += PAGE_SIZE) {
+                vm_readahead_page(as, region, vaddr);
+        }
+        region->ra_end = end;
+}
+
+/*
+ * Gets the page at faultaddress of a read-only region that only this
+ * region's file backs, sharing the frame with every other process that
+ * has the same page of the same file mapped. Hands back the frame's
+ * kernel address with a reference taken, setting *major if the page
+ * had to be read from the file.
+ */
+static int
+page_get_cached(struct addrspace *as, struct region *region,
+              vaddr_t faultaddress, vaddr_t *ret, bool *major)
+{
+        int result;
+        off_t foff;
+        paddr_t paddr;
+        vaddr_t vaddr, start, end;
+        unsigned int head, len;
+
+        region_file_span(region, faultaddress, &start, &end);
+        foff = region->offset + (start - region->filebase);
+        head = start - faultaddress;
+        len = end - start;
+
+        paddr = page_cache_lookup(region->vnode, foff, head, len);
+        if (paddr != 0) {
+                *ret = PADDR_TO_KVADDR(paddr);
+                return 0;
+        }
+
+        vaddr = vm_alloc_page(len < PAGE_SIZE);
+        if (vaddr == 0) {
+                return ENOMEM;
+        }
+
+        result = page_read_file(as, faultaddress, vaddr);
+        if (result) {
+                free_kpages(vaddr);
+                return result;
+        }
+        *major = true;
+
+        paddr = page_cache_insert(region->vnode, foff, head, len,
+                                  KVADDR_TO_PADDR(vaddr));
+        *ret = PADDR_TO_KVADDR(paddr);
+        return 0;
+}
+
+/*
+ * First write to a page of a shared file mapping: make the page 
+ * writable in place and note that it has to be written back.
+ */
+static int
+page_table_share_write(struct addrspace *as, vaddr_t faultaddress)
+{
+        struct pt_stripe *stripe;
+        struct page_table_entry *pte;
+
+        stripe = pt_lock(hpt_hash(as, faultaddress));
+        pte = page_table_get(as, faultaddress);
+        KASSERT(pte != NULL);
+        if (pte->elo & TLBLO_VALID) {
+                pte->elo |= TLBLO_DIRTY | PTE_MODIFIED;
+                vm_tlb_load(as, faultaddress, pte->elo);
+                as->usage.minflt++;
+        }
+        pt_unlock(stripe);
+
+        return 0;
 }
 
+/*
+ * Writes every page of a shared file mapping that has been written to
+ * back to the file. Each page is made clean and read-only again (and
+ * shot down) before it is written, so a store made during or after the
+ * write faults and marks it modified for the next writeback instead of
+ * being lost. Other sharers' entries keep their own marks.
+ */
 int
-page_table_copy(struct addrspace *oldas, struct addrspace *newas) 
+page_table_writeback(struct addrspace *as, struct region *region)
 {
-        struct page_table_entry *curr, *new;
+        int result;
+        uint32_t elo;
+        paddr_t paddr;
+        struct iovec iov;
+        struct uio ku;
+        vaddr_t start, end;
+        struct pt_stripe *stripe;
+        struct page_table_entry *curr;
+        struct tlb_batch tb;
 
-        for (size_t i = 0; i < hpt_size; i++) {
-                lock_acquire(pt_lock);
-                for(curr = page_table[i]; curr != NULL; curr = curr->next) {
-                        if (curr->pid == (uint32_t) oldas) {
-                                new = page_table_insert(newas, 
-                                                        curr->vpn, 
-                                                        curr->elo & ~TLBLO_PPAGE);
-                                if (new == NULL) {
-                                        return ENOMEM;
-                                }
+        for (curr = as->pages; curr != NULL; curr = curr->as_next) {
+                if (curr->vpn < region->vbase ||
+                    curr->vpn >= region->vbase + region->size ||
+                    !region_file_span(region, curr->vpn, &start, &end)) {
+                        continue;
+                }
+
+                /* hold on to the frame while we write it out */
+                stripe = pt_lock(hpt_hash(as, curr->vpn));
+                elo = curr->elo;
+                if ((elo & (TLBLO_VALID | PTE_MODIFIED)) != 
+                    (TLBLO_VALID | PTE_MODIFIED)) {
+                        pt_unlock(stripe);
+                        continue;
+                }
+                paddr = elo & TLBLO_PPAGE;
+                frame_ref(paddr);
+                curr->elo &= ~(TLBLO_DIRTY | PTE_MODIFIED);
+                pt_unlock(stripe);
+
+                tlb_batch_init(&tb, as);
+                tlb_batch_add(&tb, curr->vpn);
+                tlb_batch_flush(&tb, true);
 
-                                memmove((void *) PADDR_TO_KVADDR(new->elo & TLBLO_PPAGE),
-                                        (void *) PADDR_TO_KVADDR(curr->elo & TLBLO_PPAGE),
-                                        PAGE_SIZE);
+                uio_kinit(&iov, &ku, 
+                          (void *) (PADDR_TO_KVADDR(paddr) + 
+                                    (start - curr->vpn)),
+                          end - start, 
+                          region->offset + (start - region->filebase),
+                          UIO_WRITE);
+                result = VOP_WRITE(region->vnode, &ku);
+                if (result) {
+                        /* still needs writing, unless the page moved on */
+                        stripe = pt_lock(hpt_hash(as, curr->vpn));
+                        if ((curr->elo & TLBLO_PPAGE) == paddr) {
+                                curr->elo |= PTE_MODIFIED;
                         }
+                        pt_unlock(stripe);
+                }
+                free_kpages(PADDR_TO_KVADDR(paddr));
+                if (result) {
+                        return result;
                 }
-                lock_release(pt_lock); 
         }
 
         return 0;
 }
 
-void
-page_table_remove(struct addrspace *as) 
+/*
+ * The rest of vm_fault, for faults the lock-free lookup could not
+ * settle: anything that takes a stripe lock, allocates or does I/O.
+ */
+static int
+vm_fault_slow(struct addrspace *as, int faulttype, vaddr_t faultaddress)
 {
-        struct page_table_entry *curr, *next, *prev;
+        int result;
+        bool cached, zero, major;
+        size_t filebytes;
+        uint32_t perms, elo;
+        vaddr_t vaddr, start, end;
+        struct region *region;
+        struct page_table_entry *pte;
+        struct pt_stripe *stripe;
 
-        for (size_t i = 0; i < hpt_size; i++) {
-                lock_acquire(pt_lock);
-                prev = NULL;
-                for (curr = page_table[i]; curr != NULL; curr = next) {
-                        next = curr->next;
-                        if (curr->pid == (uint32_t) as) {
-                                free_kpages(PADDR_TO_KVADDR(curr->elo & TLBLO_PPAGE));
-                                kfree(curr);
-                                if (prev != NULL) {
-                                        prev->next = next;
-                                }
-                                else {
-                                        page_table[i] = next;
-                                }
+        stripe = pt_lock(hpt_hash(as, faultaddress));
+        pte = page_table_get(as, faultaddress);
+        if (pte != NULL) {
+                pt_wait(stripe, pte);
+                if (pte->elo & PTE_SWAPPED) {
+                        VMSTAT_INC(pt_misses);
+                        pte->elo |= PTE_BUSY;
+                        pt_unlock(stripe);
+                        result = page_swapin(as, pte, faulttype,
+                                             faultaddress);
+                        region = as_find_region(as, faultaddress);
+                        if (result == 0 && region != NULL) {
+                                vm_readahead(as, region, faultaddress);
                         }
-                        else {
-                                prev = curr;
+                        return result;
+                }
+                if (faulttype == VM_FAULT_READ ||
+                    (pte->elo & TLBLO_DIRTY) || as->load) {
+                        elo = as->load ? (pte->elo | TLBLO_DIRTY) : pte->elo;
+                        vm_tlb_load(as, faultaddress, elo);
+                        pt_unlock(stripe);
+                        VMSTAT_INC(pt_hits);
+                        vm_faultaround(as, faultaddress);
+                        return 0;
+                }
+        }
+        pt_unlock(stripe);
+        VMSTAT_INC(pt_misses);
+
+        /* find valid region */
+        region = as_find_region(as, faultaddress);
+        if (region == NULL) {
+                /* a fault just under the stack grows it */
+                if (as_grow_stack(as, faultaddress)) {
+                        return EFAULT;
+                }
+                region = as->stack;
+        }
+
+        if (pte != NULL) {
+                /* only copy-on-write pages of writable regions */
+                if (!(region->accmode & RGN_W)) {
+                        return EFAULT;
+                }
+
+                /* shared file mappings are written in place */
+                if (region->accmode & RGN_SHARED) {
+                        return page_table_share_write(as, faultaddress);
+                }
+
+                return page_table_cow(as, faultaddress);
+        }
+
+        if (faulttype == VM_FAULT_READONLY) {
+                return EFAULT;
+        }
+
+        /* check if region is writable */
+        perms = TLBLO_VALID;
+        if (region->accmode & RGN_W) {
+                perms |= TLBLO_DIRTY;
+        }
+
+        /* 
+         * allocate a frame, zero filled unless the file covers it all,
+         * and read in what comes from the file. Pages of read-only text
+         * and of file mappings come from the page cache instead, so 
+         * they are shared with everyone else using the same file, and
+         * reads of anonymous memory just map the zero page.
+         */
+        cached = false;
+        zero = false;
+        major = false;
+        filebytes = page_file_bytes(as, faultaddress);
+        if (filebytes == 0 && faulttype == VM_FAULT_READ && !as->load &&
+            !(region->accmode & RGN_MMAP)) {
+                frame_ref(KVADDR_TO_PADDR(zero_page));
+                vaddr = zero_page;
+                zero = true;
+                VMSTAT_INC(zero_maps);
+
+                /* the first write copies it, as for any shared frame */
+                perms = TLBLO_VALID;
+        }
+        else if (filebytes > 0 && !as->load &&
+            ((region->accmode & RGN_MMAP) || !(region->accmode & RGN_W)) &&
+            region_file_span(region, faultaddress, &start, &end) &&
+            end - start == filebytes) {
+                result = page_get_cached(as, region, faultaddress, &vaddr,
+                                         &major);
+                if (result) {
+                        return result;
+                }
+                cached = true;
+
+                /* 
+                 * nobody may write to a cached frame unless the mapping
+                 * is shared, and then we note that it needs writing back
+                 */
+                perms = TLBLO_VALID;
+                if ((region->accmode & RGN_SHARED) &&
+                    (region->accmode & RGN_W) &&
+                    faulttype == VM_FAULT_WRITE) {
+                        perms |= TLBLO_DIRTY | PTE_MODIFIED;
+                }
+        }
+        else {
+                vaddr = vm_alloc_page(filebytes < PAGE_SIZE);
+                if (vaddr == 0) {
+                        return ENOMEM;
+                }
+                if (filebytes > 0 &&
+                    !page_copy_cached(region, faultaddress, filebytes, vaddr)) {
+                        result = page_read_file(as, faultaddress, vaddr);
+                        if (result) {
+                                free_kpages(vaddr);
+                                return result;
                         }
+                        major = true;
                 }
-                lock_release(pt_lock); 
         }
-}
 
-void vm_bootstrap(void)
-{
-        unsigned int nframes;
-        paddr_t top_of_ram = ram_getsize();
+        /* insert into page table */
+        elo = KVADDR_TO_PADDR(vaddr) | perms;
+        pte = page_table_insert(as, faultaddress, elo);
+        if (pte == NULL) {
+                free_kpages(vaddr);
+                return ENOMEM;
+        }
 
-        nframes = top_of_ram / PAGE_SIZE;
-        hpt_size = nframes * 2;
+        /*
+         * valid translation, write into tlb. The frame can't be paged
+         * out until it is handed to the page below (or while it is 
+         * shared).
+         */
+        vm_tlb_load(as, faultaddress, as->load ? (elo | TLBLO_DIRTY) : elo);
 
-        page_table = kmalloc(hpt_size * sizeof(struct page_table_entry *));
-        frame_table = kmalloc(nframes * sizeof(struct frame_table_entry));
+        /* 
+         * mapped file pages stay resident until they are unmapped, and
+         * the zero page is never paged out (nor kept track of, as it is
+         * mapped everywhere)
+         */
+        if (cached && (region->accmode & RGN_MMAP)) {
+                frame_add_owner(KVADDR_TO_PADDR(vaddr), pte);
+        }
+        else if (!zero) {
+                frame_set_user(KVADDR_TO_PADDR(vaddr), pte);
+        }
 
-        frame_table_init(nframes);
-        page_table_init();
+        if (major) {
+                as->usage.majflt++;
+        }
+        else {
+                as->usage.minflt++;
+        }
+
+        if (filebytes > 0) {
+                vm_readahead(as, region, faultaddress);
+        }
 
-        pt_lock = lock_create("page_table_lock");
+        vm_faultaround(as, faultaddress);
+        return 0;
 }
 
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
-        int spl;
-        uint32_t perms, elo;
+        int spl, result;
+        uint32_t elo, seq;
         struct addrspace *as;
-        struct region *region;
-        struct page_table_entry *pte;
+        struct pt_stripe *stripe;
+        struct timespec start;
 
         faultaddress &= PAGE_FRAME;
 
         switch (faulttype) {
                 case VM_FAULT_READONLY:
-                        return EFAULT;
                 case VM_FAULT_READ:
                 case VM_FAULT_WRITE:
                         break;
@@ -203,52 +1837,64 @@ vm_fault(int faulttype, vaddr_t faultaddress)
                 return EFAULT;
         }
 
-        lock_acquire(pt_lock);
-        pte = page_table_get(as, faultaddress);
-        lock_release(pt_lock);
-
-        if (pte == NULL) {
-                /* find valid region */
-                region = region_get(as, faultaddress);
+        if (faulttype != VM_FAULT_READONLY) {
+                VMSTAT_INC(tlb_misses);
+        }
+        else {
+                VMSTAT_INC(tlb_readonly);
+        }
 
-                if (region == NULL) {
-                        return EFAULT;
+        /*
+         * Fast path: a resident translation that allows the access. If
+         * the entry changed under us (e.g. it was paged out) after the
+         * snapshot, take the tlb entry back out and fault again.
+         */
+        if (page_table_peek(as, faultaddress, &elo, &seq) &&
+            (elo & TLBLO_VALID) &&
+            (faulttype == VM_FAULT_READ || (elo & TLBLO_DIRTY) || as->load)) {
+                if (as->load) {
+                        elo |= TLBLO_DIRTY;
                 }
 
-                /* check if region is writable */
-                perms = TLBLO_VALID;
-                if (region->accmode & RGN_W) {
-                        perms |= TLBLO_DIRTY;
+                stripe = &pt_stripes[hpt_hash(as, faultaddress) % PT_STRIPES];
+                spl = splhigh();
+                vm_tlb_load(as, faultaddress, elo);
+                membar_load_load();
+                if (stripe->seq != seq) {
+                        vm_tlb_invalidate(as, faultaddress);
                 }
+                splx(spl);
 
-                /* insert into page table */
-                lock_acquire(pt_lock);
-                pte = page_table_insert(as, faultaddress, perms);
-                lock_release(pt_lock);
-
-                if (pte == NULL) {
-                        return ENOMEM;
-                }
+                VMSTAT_INC(pt_hits);
+                vm_faultaround(as, faultaddress);
+                return 0;
         }
-        elo = as->load ? (pte->elo | TLBLO_DIRTY) : pte->elo;
 
-        /* valid translation, write into tlb */
-        spl = splhigh();
-        tlb_random(faultaddress, elo);
-        splx(spl);
+        gettime(&start);
+        result = vm_fault_slow(as, faulttype, faultaddress);
+        vmstat_fault_done(&start);
 
-        return 0;
+        return result;
 }
 
 /*
- *
- * SMP-specific functions.  Unused in our configuration.
+ * Handles one shootdown request on the cpu it was sent to, from the
+ * IPI handler. tlb_batch_flush sends a batch only to the cpus that may
+ * hold the address space's entries, under tlb_shootdown_lock so that
+ * one batch at a time is queued and no cpu's queue (TLBSHOOTDOWN_MAX
+ * deep) can overflow; a batch bigger than that is sent as a single
+ * TS_ALL request that drops every entry of the ASID. Only the batch's
+ * last request carries the sender's done[] array: requests are handled
+ * in order, so raising this cpu's flag there tells the sender, which
+ * spins on done[] for every target, that the whole batch is gone.
  */
-
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-        (void)ts;
-        panic("vm tried to do tlb shootdown?!\n");
-}
+        vm_tlb_drop(ts->ts_asid, ts->ts_vaddr);
 
+        if (ts->ts_done != NULL) {
+                membar_store_store();
+                ts->ts_done[curcpu->c_number] = true;
+        }
+}
@@ -0,0 +1,264 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <stdarg.h>
+#include <lib.h>
+#include <clock.h>
+#include <uio.h>
+#include <device.h>
+#include <vfs.h>
+#include <vm.h>
+#include <vmstat.h>
+
+/*
+ * VM statistics (see vmstat.h). The counters are summed and formatted
+ * on demand, one "name value" pair per line, both for the kernel menu
+ * and for reads of the vmstat: device.
+ */
+
+#define VMSTAT_BUFSIZE 2048
+
+struct vmstat vmstat_cpu[MAXCPUS];
+
+struct vmstat_buf {
+        char *buf;
+        size_t size;
+        size_t len;
+};
+
+void
+vmstat_sum(struct vmstat *total)
+{
+        unsigned int i, j;
+        unsigned int *sum;
+        const unsigned int *counts;
+
+        /* the struct is nothing but counters */
+        bzero(total, sizeof(*total));
+        sum = (unsigned int *) total;
+        for (i = 0; i < MAXCPUS; i++) {
+                counts = (const unsigned int *) &vmstat_cpu[i];
+                for (j = 0; j < sizeof(*total) / sizeof(*sum); j++) {
+                        sum[j] += counts[j];
+                }
+        }
+}
+
+/*
+ * Files the time since START under the fault latency histogram. The
+ * clock is only read for faults that get past the lock-free lookup, so
+ * the fast path pays nothing for it.
+ */
+void
+vmstat_fault_done(const struct timespec *start)
+{
+        unsigned int bucket;
+        uint64_t usecs;
+        struct timespec now, diff;
+
+        gettime(&now);
+        timespec_sub(&now, start, &diff);
+        usecs = (uint64_t) diff.tv_sec * 1000000 + diff.tv_nsec / 1000;
+
+        bucket = 0;
+        while (usecs >= 2 && bucket < VMSTAT_LAT_BUCKETS - 1) {
+                usecs >>= 1;
+                bucket++;
+        }
+
+        VMSTAT_INC(fault_lat[bucket]);
+}
+
+static void
+vmstat_printf(struct vmstat_buf *vb, const char *fmt, ...)
+{
+        va_list ap;
+
+        if (vb->len + 1 >= vb->size) {
+                return;
+        }
+
+        va_start(ap, fmt);
+        vb->len += vsnprintf(vb->buf + vb->len, vb->size - vb->len, fmt, ap);
+        va_end(ap);
+
+        if (vb->len >= vb->size) {
+                vb->len = vb->size - 1;
+        }
+}
+
+/* Formats everything into buf, returning the length of the text */
+static size_t
+vmstat_format(char *buf, size_t size)
+{
+        unsigned int i, total, free, avg;
+        struct vmstat vs;
+        struct pt_chain_stats pcs;
+        struct vmstat_buf vb;
+
+        vb.buf = buf;
+        vb.size = size;
+        vb.len = 0;
+
+        vmstat_sum(&vs);
+        page_table_chains(&pcs);
+        total = frame_total_count();
+        free = frame_free_count();
+
+        /* free frames are read without locks, so keep used sane */
+        if (free > total) {
+                free = total;
+        }
+        /* average length of the chains in use, in hundredths */
+        avg = (pcs.used == 0) ? 0 : (pcs.entries * 100) / pcs.used;
+
+        vmstat_printf(&vb, "frames_total %u\n", total);
+        vmstat_printf(&vb, "frames_free %u\n", free);
+        vmstat_printf(&vb, "frames_used %u\n", total - free);
+        vmstat_printf(&vb, "frames_zero_pool %u\n", frame_zero_count());
+        vmstat_printf(&vb, "frame_allocs %u\n", vs.frame_allocs);
+        vmstat_printf(&vb, "frame_frees %u\n", vs.frame_frees);
+        vmstat_printf(&vb, "frame_cache_refills %u\n", vs.cache_refills);
+        vmstat_printf(&vb, "frame_cache_drains %u\n", vs.cache_drains);
+        vmstat_printf(&vb, "zero_fills %u\n", vs.zero_fills);
+        vmstat_printf(&vb, "zero_pool_hits %u\n", vs.zero_pool_hits);
+        vmstat_printf(&vb, "zero_page_maps %u\n", vs.zero_maps);
+        vmstat_printf(&vb, "tlb_misses %u\n", vs.tlb_misses);
+        vmstat_printf(&vb, "tlb_readonly %u\n", vs.tlb_readonly);
+        vmstat_printf(&vb, "faultaround_loads %u\n", vs.faultaround_loads);
+        vmstat_printf(&vb, "pt_hits %u\n", vs.pt_hits);
+        vmstat_printf(&vb, "pt_misses %u\n", vs.pt_misses);
+        vmstat_printf(&vb, "pt_locks %u\n", vs.pt_locks);
+        vmstat_printf(&vb, "pt_lock_contended %u\n", vs.pt_contended);
+        vmstat_printf(&vb, "hpt_chains %u\n", pcs.buckets);
+        vmstat_printf(&vb, "hpt_chains_used %u\n", pcs.used);
+        vmstat_printf(&vb, "hpt_entries %u\n", pcs.entries);
+        vmstat_printf(&vb, "hpt_chain_longest %u\n", pcs.longest);
+        vmstat_printf(&vb, "hpt_chain_avg %u.%02u\n", avg / 100, avg % 100);
+        vmstat_printf(&vb, "cow_copies %u\n", vs.cow_copies);
+        vmstat_printf(&vb, "swapins %u\n", vs.swapins);
+        vmstat_printf(&vb, "swapins_cached %u\n", vs.swapins_cached);
+        vmstat_printf(&vb, "pageouts %u\n", vs.pageouts);
+        vmstat_printf(&vb, "pageouts_clean %u\n", vs.pageouts_clean);
+        vmstat_printf(&vb, "zswap_stores %u\n", vs.zswap_stores);
+        vmstat_printf(&vb, "zswap_loads %u\n", vs.zswap_loads);
+        vmstat_printf(&vb, "swap_disk_writes %u\n", vs.disk_writes);
+        vmstat_printf(&vb, "swap_disk_reads %u\n", vs.disk_reads);
+
+        /* slow-path fault latency, bucket i being [2^i, 2^(i+1)) us */
+        vmstat_printf(&vb, "fault_us_0_2 %u\n", vs.fault_lat[0]);
+        for (i = 1; i < VMSTAT_LAT_BUCKETS - 1; i++) {
+                vmstat_printf(&vb, "fault_us_%u_%u %u\n",
+                              1U << i, 2U << i, vs.fault_lat[i]);
+        }
+        vmstat_printf(&vb, "fault_us_%u_up %u\n",
+                      1U << i, vs.fault_lat[i]);
+
+        return vb.len;
+}
+
+/* Prints the statistics on the console, for the kernel menu */
+void
+vmstat_print(void)
+{
+        char *buf;
+
+        buf = kmalloc(VMSTAT_BUFSIZE);
+        if (buf == NULL) {
+                kprintf("vmstat: out of memory\n");
+                return;
+        }
+
+        vmstat_format(buf, VMSTAT_BUFSIZE);
+        kprintf("%s", buf);
+        kfree(buf);
+}
+
+/*
+ * The vmstat: device. Every read formats a fresh copy of the text and
+ * hands back the part at the file offset, so reading it through from
+ * the start gives one consistent-enough snapshot. The device claims
+ * VMSTAT_BUFSIZE bytes so that it is seekable: otherwise every read
+ * would be at offset 0 and a reader would never see end of file.
+ */
+static int
+vmstat_eachopen(struct device *dev, int openflags)
+{
+        (void) dev;
+
+        if ((openflags & O_ACCMODE) != O_RDONLY) {
+                return EIO;
+        }
+
+        return 0;
+}
+
+static int
+vmstat_io(struct device *dev, struct uio *uio)
+{
+        int result;
+        size_t len;
+        char *buf;
+
+        (void) dev;
+
+        if (uio->uio_rw != UIO_READ) {
+                return EIO;
+        }
+
+        buf = kmalloc(VMSTAT_BUFSIZE);
+        if (buf == NULL) {
+                return ENOMEM;
+        }
+
+        len = vmstat_format(buf, VMSTAT_BUFSIZE);
+        result = 0;
+        if (uio->uio_offset >= 0 && uio->uio_offset < (off_t) len) {
+                result = uiomove(buf + uio->uio_offset,
+                                 len - uio->uio_offset, uio);
+        }
+
+        kfree(buf);
+        return result;
+}
+
+static int
+vmstat_ioctl(struct device *dev, int op, userptr_t data)
+{
+        (void) dev;
+        (void) op;
+        (void) data;
+
+        return EINVAL;
+}
+
+static const struct device_ops vmstat_devops = {
+        .devop_eachopen = vmstat_eachopen,
+        .devop_io = vmstat_io,
+        .devop_ioctl = vmstat_ioctl,
+};
+
+/* Attaches vmstat:, once the frame and page tables are up */
+void
+vmstat_bootstrap(void)
+{
+        int result;
+        struct device *dev;
+
+        dev = kmalloc(sizeof(*dev));
+        if (dev == NULL) {
+                panic("vmstat_bootstrap: out of memory\n");
+        }
+
+        dev->d_ops = &vmstat_devops;
+        dev->d_blocks = VMSTAT_BUFSIZE;
+        dev->d_blocksize = 1;
+        dev->d_devnumber = 0;   /* assigned by vfs_adddev */
+        dev->d_data = NULL;
+
+        result = vfs_adddev("vmstat", dev, 0);
+        if (result) {
+                panic("vmstat_bootstrap: vfs_adddev failed: %s\n",
+                      strerror(result));
+        }
+}
@@ -0,0 +1,92 @@
+#!/usr/pkg/bin/python2.7
+# vmtests.py - run the VM tests on the machines they are meant for
+# usage: vmtests.py [test-name...]
+#
+# Run from the root of the installed tree (where the kernels are), with
+# both the ASST3 and the ASST3-IPT kernels built and installed.
+# Each test boots its own System/161 with the kernel and number of
+# cpus it needs, runs its commands, and fails if the output has a
+# panic or a FAILED line in it, or is missing the line that says it
+# passed. With no arguments every test is run.
+#
+# See the top of runtest.py for how the commands are run.
+#
+
+import sys
+import StringIO
+
+import runtest
+
+############################################################
+# the tests
+#
+# name, kernel, cpus, commands, line that shows it passed
+
+g_tests = [
+	("cowtest", "kernel-ASST3", 4,
+		"p /testbin/cowtest", "cowtest: passed"),
+	("pttest", "kernel-ASST3", 4,
+		"p /testbin/pttest", "pttest: passed"),
+	("km5", "kernel-ASST3", 1,
+		"km5", "Buddy allocator test done"),
+	("parallelvm-ipt", "kernel-ASST3-IPT", 4,
+		"p /testbin/parallelvm", "Test complete"),
+	("bigfork-ipt", "kernel-ASST3-IPT", 4,
+		"p /testbin/bigfork", "Done."),
+	("parallelvm-smp", "kernel-ASST3", 4,
+		"p /testbin/parallelvm", "Test complete"),
+	("bigfork-smp", "kernel-ASST3", 4,
+		"p /testbin/bigfork", "Done."),
+	("zswaptest-smp", "kernel-ASST3", 4,
+		"p /testbin/zswaptest", "zswaptest: passed"),
+	("cowtest-ipt", "kernel-ASST3-IPT", 4,
+		"p /testbin/cowtest", "cowtest: passed"),
+]
+
+############################################################
+# running them
+
+# Copies what it is given to stdout and keeps it
+class Tee:
+	def __init__(self):
+		self.text = StringIO.StringIO()
+	def write(self, s):
+		sys.stdout.write(s)
+		self.text.write(s)
+	def flush(self):
+		sys.stdout.flush()
+# end Tee
+
+def runone(name, kernel, cpus, commands, passed):
+	sys.stdout.write("vmtests: %s on %s, %d cpus\n" % (name, kernel, cpus))
+	out = Tee()
+	msg = runtest.run(commands, out, cpus=cpus, kernel=kernel)
+	text = out.text.getvalue()
+	if msg is not None:
+		return msg
+	if text.find("panic") >= 0:
+		return "kernel panic"
+	if text.find("FAILED") >= 0:
+		return "test failed"
+	if text.find(passed) < 0:
+		return "no \"%s\" in the output" % passed
+	return None
+# end runone
+
+names = sys.argv[1:]
+failures = 0
+for (name, kernel, cpus, commands, passed) in g_tests:
+	if len(names) > 0 and name not in names:
+		continue
+	msg = runone(name, kernel, cpus, commands, passed)
+	if msg is not None:
+		sys.stdout.write("vmtests: %s: FAILED: %s\n" % (name, msg))
+		failures += 1
+	else:
+		sys.stdout.write("vmtests: %s: ok\n" % name)
+
+if failures > 0:
+	sys.stdout.write("vmtests: %d failed\n" % failures)
+	exit(1)
+sys.stdout.write("vmtests: all passed\n")
+exit(0)
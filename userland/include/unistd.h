@@ -40,9 +40,11 @@
  */
 #include <kern/fcntl.h>
 #include <kern/ioctl.h>
+#include <kern/mman.h>
 #include <kern/reboot.h>
 #include <kern/seek.h>
 #include <kern/time.h>
+#include <kern/resource.h>
 #include <kern/unistd.h>
 #include <kern/wait.h>
 
@@ -147,6 +149,9 @@ ssize_t readlink(const char *path, char *buf, size_t buflen);
 int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
 int __time(time_t *seconds, unsigned long *nanoseconds);
+int getrusage(int who, struct rusage *usage);
+int getrlimit(int resource, struct rlimit *rlp);
+int setrlimit(int resource, const struct rlimit *rlp);
 ssize_t __getcwd(char *buf, size_t buflen);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
@@ -162,11 +167,9 @@ time_t time(time_t *seconds);			/* calls __time */
 /* UNSW versions of mmap() and munmap()
  * This are simplified compared to the standard version on UNIX
  * You should implement this version as this is what we expect to test.
+ * PROT_READ, PROT_WRITE, PROT_EXEC and MAP_PRIVATE come from <kern/mman.h>.
  */
 
-#define PROT_READ 1
-#define PROT_WRITE 2
-
 void *mmap(size_t length, int prot, int fd, off_t offset);
 int munmap(void *addr);
 
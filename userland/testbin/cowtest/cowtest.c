@@ -0,0 +1,158 @@
+/*
+ * cowtest - copy-on-write fork under concurrency
+ *
+ * The parent fills some pages and forks NCHILD children, which at
+ * first share every one of them copy-on-write. Each child checks that
+ * it sees the parent's data, then keeps writing its own pattern over
+ * the pages (and, halfway, forks a grandchild of its own that does the
+ * same), while the parent keeps reading the pages and writing a few of
+ * its own. Nobody may ever see anyone else's data.
+ *
+ * Meant to be run with several cpus (e.g. cpus=4 in sys161.conf), so
+ * that the writers and readers really overlap and the copies, frame
+ * reference counts and tlb shootdowns all race.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <err.h>
+
+#define PAGE 4096
+#define NPAGES 64
+#define NWORDS (NPAGES * PAGE / sizeof(unsigned))
+#define NCHILD 3
+#define ROUNDS 20
+
+static unsigned pages[NWORDS];
+
+/* The word at index I as written by writer WHO in round ROUND */
+static
+unsigned
+value(unsigned who, unsigned round, unsigned i)
+{
+	return (who << 24) ^ (round << 16) ^ i;
+}
+
+static
+void
+fill(unsigned who, unsigned round, unsigned start, unsigned step)
+{
+	unsigned i;
+
+	for (i = start; i < NWORDS; i += step) {
+		pages[i] = value(who, round, i);
+	}
+}
+
+/* Returns the index of the first word that is not as expected, or -1 */
+static
+int
+verify(unsigned who, unsigned round, unsigned start, unsigned step)
+{
+	unsigned i;
+
+	for (i = start; i < NWORDS; i += step) {
+		if (pages[i] != value(who, round, i)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static
+void
+check(int bad, const char *who, unsigned round)
+{
+	if (bad >= 0) {
+		errx(1, "FAILED: %s round %u: word %d is 0x%x", who, round,
+		     bad, pages[bad]);
+	}
+}
+
+static
+void
+waitfor(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "FAILED: process %d did not exit cleanly", pid);
+	}
+}
+
+/* Writes and re-reads the pages as writer WHO, forking halfway if NEST */
+static
+void
+writer(unsigned who, int nest)
+{
+	unsigned round;
+	pid_t pid = -1;
+
+	for (round = 1; round <= ROUNDS; round++) {
+		fill(who, round, 0, 1);
+		check(verify(who, round, 0, 1), "child", round);
+
+		if (nest && round == ROUNDS / 2) {
+			pid = fork();
+			if (pid < 0) {
+				err(1, "fork");
+			}
+			if (pid == 0) {
+				/* starts out sharing this round's data */
+				check(verify(who, round, 0, 1), "grandchild",
+				      round);
+				writer(who + NCHILD, 0);
+				_exit(0);
+			}
+		}
+	}
+
+	if (pid > 0) {
+		waitfor(pid);
+	}
+}
+
+int
+main(void)
+{
+	unsigned i, round;
+	pid_t pids[NCHILD];
+
+	fill(0, 0, 0, 1);
+
+	for (i = 0; i < NCHILD; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			err(1, "fork");
+		}
+		if (pids[i] == 0) {
+			/* the pages are shared, and must still be ours */
+			check(verify(0, 0, 0, 1), "child", 0);
+			writer(i + 1, 1);
+			_exit(0);
+		}
+	}
+
+	/*
+	 * Meanwhile keep reading every page, and write every other word
+	 * of them, so the parent's copies get broken too.
+	 */
+	for (round = 1; round <= ROUNDS * 4; round++) {
+		check(verify(0, 0, 1, 2), "parent", round);
+		fill(0, round, 0, 2);
+		check(verify(0, round, 0, 2), "parent", round);
+	}
+
+	for (i = 0; i < NCHILD; i++) {
+		waitfor(pids[i]);
+	}
+	check(verify(0, 0, 1, 2), "parent", round);
+
+	printf("cowtest: passed\n");
+	return 0;
+}
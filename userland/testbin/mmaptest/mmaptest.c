@@ -0,0 +1,207 @@
+/*
+ * mmaptest - exercise file mappings
+ *
+ * Checks, on a scratch file:
+ *    - a private mapping sees the file, and its writes stay private;
+ *    - PROT_EXEC is accepted;
+ *    - a shared mapping's writes reach the file on fsync, write() to
+ *      the file shows through the mapping, and a page written again
+ *      after an fsync is written back again;
+ *    - munmap writes a shared mapping back and takes the pages away.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <err.h>
+
+#define FILENAME "mmaptest.dat"
+#define PAGE 4096
+#define NPAGES 2
+#define LEN (PAGE * NPAGES)
+
+static char buf[LEN];
+
+static
+char
+pattern(unsigned i)
+{
+	return 'a' + (i * 7 + i / PAGE) % 26;
+}
+
+/* Reads one byte of the file with read(), bypassing any mapping */
+static
+char
+filebyte(int fd, off_t pos)
+{
+	char c;
+
+	if (lseek(fd, pos, SEEK_SET) < 0) {
+		err(1, "lseek");
+	}
+	if (read(fd, &c, 1) != 1) {
+		err(1, "read");
+	}
+	return c;
+}
+
+static
+void
+writebyte(int fd, off_t pos, char c)
+{
+	if (lseek(fd, pos, SEEK_SET) < 0) {
+		err(1, "lseek");
+	}
+	if (write(fd, &c, 1) != 1) {
+		err(1, "write");
+	}
+}
+
+static
+char *
+map(int fd, int prot)
+{
+	char *p;
+
+	p = mmap(LEN, prot, fd, 0);
+	if (p == (void *)-1) {
+		err(1, "mmap");
+	}
+	return p;
+}
+
+static
+void
+check(int cond, const char *what)
+{
+	if (!cond) {
+		errx(1, "FAILED: %s", what);
+	}
+}
+
+static
+void
+test_private(int fd)
+{
+	char *p, *q;
+	unsigned i;
+
+	p = map(fd, PROT_READ | PROT_WRITE | MAP_PRIVATE);
+	for (i = 0; i < LEN; i++) {
+		if (p[i] != pattern(i)) {
+			errx(1, "FAILED: private mapping byte %u is %c",
+			     i, p[i]);
+		}
+	}
+
+	p[0] = 'X';
+	p[PAGE + 1] = 'Y';
+	check(p[0] == 'X' && p[PAGE + 1] == 'Y', "private write");
+	check(filebyte(fd, 0) == pattern(0), "private write reached file");
+
+	q = map(fd, PROT_READ | MAP_PRIVATE);
+	check(q[0] == pattern(0), "private write seen by another mapping");
+	check(q[PAGE + 1] == pattern(PAGE + 1),
+	      "private write seen by another mapping");
+
+	check(munmap(q) == 0, "munmap");
+
+	/* there is no execute permission to refuse, so this just reads */
+	q = map(fd, PROT_READ | PROT_EXEC | MAP_PRIVATE);
+	check(q[PAGE] == pattern(PAGE), "PROT_EXEC mapping");
+	check(munmap(q) == 0, "munmap");
+
+	check(munmap(p) == 0, "munmap");
+	check(filebyte(fd, 0) == pattern(0), "private write written back");
+	printf("mmaptest: private mapping ok\n");
+}
+
+static
+void
+test_shared(int fd)
+{
+	char *s;
+
+	s = map(fd, PROT_READ | PROT_WRITE);
+
+	s[10] = 'S';
+	check(fsync(fd) == 0, "fsync");
+	check(filebyte(fd, 10) == 'S', "shared write after fsync");
+
+	/* write() must show through, and not be undone by writeback */
+	writebyte(fd, 20, 'W');
+	check(s[20] == 'W', "write() seen through shared mapping");
+	s[30] = 'T';
+	check(fsync(fd) == 0, "fsync");
+	check(filebyte(fd, 30) == 'T', "second shared write after fsync");
+	check(filebyte(fd, 20) == 'W', "write() kept across writeback");
+
+	/* a page written back once must be written back again */
+	s[40] = 'U';
+	check(fsync(fd) == 0, "fsync");
+	check(filebyte(fd, 40) == 'U', "write after writeback");
+
+	check(munmap(s) == 0, "munmap");
+	printf("mmaptest: shared mapping ok\n");
+}
+
+static
+void
+test_munmap(int fd)
+{
+	char *s;
+	pid_t pid;
+	int status;
+
+	s = map(fd, PROT_READ | PROT_WRITE);
+	s[PAGE + 50] = 'M';
+	check(munmap(s) == 0, "munmap");
+	check(filebyte(fd, PAGE + 50) == 'M', "munmap wrote back");
+
+	/* touching the unmapped pages must kill the process */
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		s[0] = 'Z';
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	check(WIFSIGNALED(status), "unmapped page still accessible");
+
+	check(munmap(s) != 0, "second munmap");
+	printf("mmaptest: munmap ok\n");
+}
+
+int
+main(void)
+{
+	int fd;
+	unsigned i;
+
+	fd = open(FILENAME, O_RDWR | O_CREAT | O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", FILENAME);
+	}
+	for (i = 0; i < LEN; i++) {
+		buf[i] = pattern(i);
+	}
+	if (write(fd, buf, LEN) != LEN) {
+		err(1, "%s: write", FILENAME);
+	}
+
+	test_private(fd);
+	test_shared(fd);
+	test_munmap(fd);
+
+	close(fd);
+	remove(FILENAME);
+	printf("mmaptest: passed\n");
+	return 0;
+}
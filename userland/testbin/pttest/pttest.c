@@ -0,0 +1,150 @@
+/*
+ * pttest - page table stress
+ *
+ * NWORKERS processes run at once, all over the same virtual addresses,
+ * so their entries share the page table's stripes. Each one, round
+ * after round:
+ *    - touches one word in each of its pages (a fault per page at
+ *      first, a lock-free lookup after) and checks them all;
+ *    - grows its heap, touches the new pages and shrinks it again,
+ *      adding and dropping entries in bulk;
+ *    - forks a child that checks and writes some of the pages and
+ *      exits, tearing its entries down while the others look theirs
+ *      up.
+ *
+ * Meant to be run with several cpus (e.g. cpus=4 in sys161.conf).
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <err.h>
+
+#define PAGE 4096
+#define NPAGES 128
+#define HEAPPAGES 32
+#define NWORKERS 6
+#define ROUNDS 16
+
+#define WORDS_PER_PAGE (PAGE / sizeof(unsigned))
+
+static unsigned pages[NPAGES * WORDS_PER_PAGE];
+
+static
+unsigned
+value(unsigned who, unsigned round, unsigned page)
+{
+	return (who << 24) ^ (round << 12) ^ page;
+}
+
+/* One word per page, at a different place in each page */
+static
+unsigned *
+word(unsigned *base, unsigned page)
+{
+	return &base[page * WORDS_PER_PAGE + page % WORDS_PER_PAGE];
+}
+
+static
+void
+touch(unsigned *base, unsigned npages, unsigned who, unsigned round)
+{
+	unsigned i;
+
+	for (i = 0; i < npages; i++) {
+		*word(base, i) = value(who, round, i);
+	}
+}
+
+static
+void
+verify(unsigned *base, unsigned npages, unsigned who, unsigned round,
+       const char *what)
+{
+	unsigned i;
+
+	for (i = 0; i < npages; i++) {
+		if (*word(base, i) != value(who, round, i)) {
+			errx(1, "FAILED: worker %u round %u: %s page %u "
+			     "is 0x%x", who, round, what, i, *word(base, i));
+		}
+	}
+}
+
+static
+void
+waitfor(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "FAILED: process %d did not exit cleanly", pid);
+	}
+}
+
+static
+void
+worker(unsigned who)
+{
+	unsigned round;
+	unsigned *heap;
+	pid_t pid;
+
+	for (round = 1; round <= ROUNDS; round++) {
+		touch(pages, NPAGES, who, round);
+		verify(pages, NPAGES, who, round, "data");
+
+		heap = sbrk(HEAPPAGES * PAGE);
+		if (heap == (void *)-1) {
+			err(1, "sbrk");
+		}
+		touch(heap, HEAPPAGES, who, round);
+		verify(heap, HEAPPAGES, who, round, "heap");
+		if (sbrk(-HEAPPAGES * PAGE) == (void *)-1) {
+			err(1, "sbrk");
+		}
+
+		pid = fork();
+		if (pid < 0) {
+			err(1, "fork");
+		}
+		if (pid == 0) {
+			verify(pages, NPAGES, who, round, "child's data");
+			touch(pages, NPAGES / 2, who, round + 1);
+			_exit(0);
+		}
+		waitfor(pid);
+
+		/* the child's writes were its own */
+		verify(pages, NPAGES, who, round, "data after child");
+	}
+}
+
+int
+main(void)
+{
+	unsigned i;
+	pid_t pids[NWORKERS];
+
+	for (i = 0; i < NWORKERS; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			err(1, "fork");
+		}
+		if (pids[i] == 0) {
+			worker(i + 1);
+			_exit(0);
+		}
+	}
+
+	for (i = 0; i < NWORKERS; i++) {
+		waitfor(pids[i]);
+	}
+
+	printf("pttest: passed\n");
+	return 0;
+}
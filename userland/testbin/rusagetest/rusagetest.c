@@ -0,0 +1,156 @@
+/*
+ * rusagetest - check the memory accounting getrusage reports
+ *
+ * Checks that:
+ *    - touching fresh pages raises the minor fault count and the
+ *      largest resident set;
+ *    - a child's faults show up under RUSAGE_CHILDREN once it has been
+ *      waited for, and not before;
+ *    - the counts carry over an execv rather than starting again.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+
+#define _PATH_MYSELF "/testbin/rusagetest"
+
+#define PAGE 4096
+#define NPAGES 32
+
+static char pages[NPAGES * PAGE];
+
+static
+void
+getusage(int who, struct rusage *ru)
+{
+	if (getrusage(who, ru) < 0) {
+		err(1, "getrusage");
+	}
+}
+
+static
+void
+check(int cond, const char *what)
+{
+	if (!cond) {
+		errx(1, "FAILED: %s", what);
+	}
+}
+
+static
+void
+touch(void)
+{
+	unsigned i;
+
+	for (i = 0; i < NPAGES; i++) {
+		pages[i * PAGE] = i;
+	}
+}
+
+static
+void
+test_self(void)
+{
+	struct rusage before, after;
+
+	getusage(RUSAGE_SELF, &before);
+	touch();
+	getusage(RUSAGE_SELF, &after);
+
+	check(after.ru_minflt + after.ru_majflt >=
+	      before.ru_minflt + before.ru_majflt + NPAGES,
+	      "faults on fresh pages not counted");
+	check(after.ru_maxrss >= NPAGES * (PAGE / 1024),
+	      "largest resident set too small");
+	check(after.ru_maxrss >= before.ru_maxrss, "ru_maxrss went down");
+	printf("rusagetest: self ok (%lu minor, %lu major, maxrss %luk)\n",
+	       (unsigned long)after.ru_minflt, (unsigned long)after.ru_majflt,
+	       (unsigned long)after.ru_maxrss);
+}
+
+static
+void
+test_children(void)
+{
+	struct rusage before, after;
+	pid_t pid;
+	int status;
+
+	getusage(RUSAGE_CHILDREN, &before);
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		touch();
+		_exit(0);
+	}
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "child failed");
+
+	getusage(RUSAGE_CHILDREN, &after);
+	check(after.ru_minflt + after.ru_majflt >=
+	      before.ru_minflt + before.ru_majflt + NPAGES,
+	      "child's faults not counted");
+	check(after.ru_maxrss > 0, "child's resident set not counted");
+	printf("rusagetest: children ok (%lu minor, %lu major)\n",
+	       (unsigned long)after.ru_minflt, (unsigned long)after.ru_majflt);
+}
+
+/* Runs in the new image, given the counts from before the execv */
+static
+void
+test_afterexec(const char *minflt, const char *maxrss)
+{
+	struct rusage ru;
+
+	getusage(RUSAGE_SELF, &ru);
+	check(ru.ru_minflt >= (unsigned)atoi(minflt), "execv reset ru_minflt");
+	check(ru.ru_maxrss >= (unsigned)atoi(maxrss), "execv reset ru_maxrss");
+	printf("rusagetest: execv ok (%lu minor, maxrss %luk)\n",
+	       (unsigned long)ru.ru_minflt, (unsigned long)ru.ru_maxrss);
+	printf("rusagetest: passed\n");
+}
+
+static
+void
+test_exec(void)
+{
+	struct rusage ru;
+	char minflt[16], maxrss[16];
+	char *args[4];
+
+	getusage(RUSAGE_SELF, &ru);
+	snprintf(minflt, sizeof(minflt), "%lu", (unsigned long)ru.ru_minflt);
+	snprintf(maxrss, sizeof(maxrss), "%lu", (unsigned long)ru.ru_maxrss);
+
+	args[0] = (char *)"rusagetest";
+	args[1] = minflt;
+	args[2] = maxrss;
+	args[3] = NULL;
+	execv(_PATH_MYSELF, args);
+	err(1, "execv");
+}
+
+int
+main(int argc, char *argv[])
+{
+	if (argc == 3) {
+		test_afterexec(argv[1], argv[2]);
+		return 0;
+	}
+
+	test_self();
+	test_children();
+	test_exec();
+	return 1;
+}
@@ -0,0 +1,89 @@
+/*
+ * vmstat - print the kernel's VM statistics
+ *
+ * Reads the vmstat: device through to end of file and copies it to
+ * standard output. Fails if the device never reaches end of file, if
+ * it accepts writes, or if the text is missing a counter it should
+ * always have.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+/* far more than the kernel ever formats */
+#define MAXTEXT 16384
+
+static char text[MAXTEXT + 1];
+
+/* Checks that the text has a "NAME value" line */
+static
+int
+hasline(const char *name)
+{
+	const char *line;
+	size_t len;
+
+	len = strlen(name);
+	line = text;
+	while (*line != 0) {
+		if (memcmp(line, name, len) == 0 && line[len] == ' ') {
+			return 1;
+		}
+		line = strchr(line, '\n');
+		if (line == NULL) {
+			break;
+		}
+		line++;
+	}
+	return 0;
+}
+
+int
+main(void)
+{
+	int fd;
+	ssize_t r;
+	size_t len;
+
+	fd = open("vmstat:", O_WRONLY);
+	if (fd >= 0) {
+		errx(1, "vmstat: opened for writing");
+	}
+
+	fd = open("vmstat:", O_RDONLY);
+	if (fd < 0) {
+		err(1, "vmstat:");
+	}
+
+	/* read in small pieces so the offset has to advance */
+	len = 0;
+	while (1) {
+		if (len >= MAXTEXT) {
+			errx(1, "vmstat: no end of file after %u bytes",
+			     (unsigned)len);
+		}
+		r = read(fd, text + len, 100);
+		if (r < 0) {
+			err(1, "vmstat: read");
+		}
+		if (r == 0) {
+			break;
+		}
+		len += r;
+	}
+	text[len] = 0;
+	close(fd);
+
+	if (!hasline("frames_total") || !hasline("tlb_misses")) {
+		errx(1, "vmstat: unexpected text");
+	}
+
+	if (write(STDOUT_FILENO, text, len) != (ssize_t)len) {
+		err(1, "stdout");
+	}
+
+	return 0;
+}
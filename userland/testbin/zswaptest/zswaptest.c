@@ -0,0 +1,163 @@
+/*
+ * zswaptest - check that paging goes to compressed swap first
+ *
+ * Touches a quarter again as much memory as the machine has, filled
+ * with pages that compress well (but are not one word repeated), then
+ * checks through vmstat: that pages were kept compressed in memory and
+ * that none had to go to the swap disk: the compressed pool is a
+ * quarter of memory, which is room for all of them. Then reads every
+ * page back to check that they came back intact.
+ *
+ * Works with or without a swap disk.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define PAGE 4096
+
+/* far more than the kernel ever formats */
+#define MAXTEXT 16384
+
+static char text[MAXTEXT + 1];
+
+/* Reads the vmstat: device into text */
+static
+void
+readstats(void)
+{
+	int fd;
+	ssize_t r;
+	size_t len;
+
+	fd = open("vmstat:", O_RDONLY);
+	if (fd < 0) {
+		err(1, "vmstat:");
+	}
+
+	len = 0;
+	while (1) {
+		if (len >= MAXTEXT) {
+			errx(1, "vmstat: no end of file");
+		}
+		r = read(fd, text + len, MAXTEXT - len);
+		if (r < 0) {
+			err(1, "vmstat: read");
+		}
+		if (r == 0) {
+			break;
+		}
+		len += r;
+	}
+	text[len] = 0;
+	close(fd);
+}
+
+/* Returns the value of the "NAME value" line of the last readstats */
+static
+unsigned
+getstat(const char *name)
+{
+	const char *line;
+	size_t len;
+
+	len = strlen(name);
+	line = text;
+	while (line != NULL && *line != 0) {
+		if (memcmp(line, name, len) == 0 && line[len] == ' ') {
+			return atoi(line + len + 1);
+		}
+		line = strchr(line, '\n');
+		if (line != NULL) {
+			line++;
+		}
+	}
+	errx(1, "vmstat: no %s", name);
+	return 0;
+}
+
+/* Fills page I with a short run repeated, starting with its number */
+static
+void
+fill(char *page, unsigned i)
+{
+	unsigned j;
+
+	for (j = 0; j < PAGE; j++) {
+		page[j] = (char)('a' + (j + i) % 16);
+	}
+	memcpy(page, &i, sizeof(i));
+}
+
+static
+int
+check(const char *page, unsigned i)
+{
+	unsigned j, n;
+
+	memcpy(&n, page, sizeof(n));
+	if (n != i) {
+		return 0;
+	}
+	for (j = sizeof(n); j < PAGE; j++) {
+		if (page[j] != (char)('a' + (j + i) % 16)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int
+main(void)
+{
+	unsigned npages, i;
+	unsigned stores, diskwrites, loads;
+	char *mem;
+
+	readstats();
+	npages = getstat("frames_total") + getstat("frames_total") / 4;
+	stores = getstat("zswap_stores");
+	diskwrites = getstat("swap_disk_writes");
+	loads = getstat("zswap_loads");
+
+	printf("zswaptest: touching %u pages\n", npages);
+	mem = sbrk(npages * PAGE);
+	if (mem == (void *)-1) {
+		err(1, "sbrk");
+	}
+	for (i = 0; i < npages; i++) {
+		fill(mem + i * PAGE, i);
+	}
+
+	readstats();
+	stores = getstat("zswap_stores") - stores;
+	diskwrites = getstat("swap_disk_writes") - diskwrites;
+	printf("zswaptest: %u pages compressed, %u written to disk\n",
+	       stores, diskwrites);
+	if (stores == 0) {
+		errx(1, "FAILED: nothing went to compressed swap");
+	}
+	if (diskwrites != 0) {
+		errx(1, "FAILED: pages went to disk with the pool not full");
+	}
+
+	for (i = 0; i < npages; i++) {
+		if (!check(mem + i * PAGE, i)) {
+			errx(1, "FAILED: page %u came back wrong", i);
+		}
+	}
+
+	readstats();
+	loads = getstat("zswap_loads") - loads;
+	printf("zswaptest: %u pages read back from compressed swap\n", loads);
+	if (loads == 0) {
+		errx(1, "FAILED: nothing came back from compressed swap");
+	}
+
+	printf("zswaptest: passed\n");
+	return 0;
+}